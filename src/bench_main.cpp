@@ -0,0 +1,299 @@
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <dlfcn.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "classad/classad_distribution.h"
+#include "XrdSys/XrdSysPthread.hh"
+#include "XrdSys/XrdSysTimer.hh"
+
+#include "fake_redirector.h"
+#include "time_utils.h"
+
+using namespace classad;
+using namespace ClassadXrootdMapping;
+
+typedef void (*SetBackendFunc)(LocateBackend *, HostnameResolver *);
+
+static const char *redirector = "fake.bench";
+
+/*
+ * The synthetic workload, shared by all threads.
+ */
+struct Workload {
+	unsigned int threads;
+	unsigned int ops;         // Evaluations per thread.
+	unsigned int files;       // Files per ad.
+	unsigned int hot_files;   // Files warmed into the cache beforehand.
+	unsigned int hit_percent; // Share of the files drawn from the warm ones.
+	double zipf;              // Skew of the draws; 0 is uniform.
+	std::vector<double> cdf;  // Cumulative draw probability of each warm file.
+};
+
+struct Worker {
+	const Workload *workload;
+	unsigned int id;
+	ClassAd *ad;
+	std::vector<unsigned int> latencies_us;
+	unsigned int errors;
+};
+
+static std::string hot_file(unsigned int idx)
+{
+	std::stringstream name;
+	name << "/store/bench/hot/" << idx / 1000 << "/file" << idx << ".root";
+	return name.str();
+}
+
+static std::string cold_file(unsigned int worker, unsigned int idx)
+{
+	std::stringstream name;
+	name << "/store/bench/cold/" << worker << "/file" << idx << ".root";
+	return name.str();
+}
+
+// xorshift64; each thread has its own state.
+static uint64_t next_random(uint64_t &state)
+{
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+static void set_files(ClassAd &ad, const std::vector<std::string> &filenames)
+{
+	std::vector<ExprTree *> exprs;
+	exprs.reserve(filenames.size());
+	for (std::vector<std::string>::const_iterator it = filenames.begin(); it != filenames.end(); ++it)
+	{
+		Value value;
+		value.SetStringValue(*it);
+		exprs.push_back(Literal::MakeLiteral(value));
+	}
+	ExprTree *list = ExprList::MakeExprList(exprs);
+	ad.Insert("files", list);
+}
+
+static ClassAd *make_ad()
+{
+	ClassAdParser parser;
+	std::string ad_str = std::string("[ files = {}; sites = files_to_sites(\"") + redirector + "\", files) ]";
+	return parser.ParseClassAd(ad_str, true);
+}
+
+static void *run_worker(void *arg)
+{
+	Worker &worker = *static_cast<Worker *>(arg);
+	const Workload &workload = *worker.workload;
+	uint64_t state = 0x2545f4914f6cdd1dULL * (worker.id + 1);
+	unsigned int cold_count = 0;
+
+	std::vector<std::string> filenames;
+	worker.latencies_us.reserve(workload.ops);
+	for (unsigned int op = 0; op < workload.ops; op++)
+	{
+		filenames.clear();
+		for (unsigned int idx = 0; idx < workload.files; idx++)
+		{
+			if (next_random(state) % 100 < workload.hit_percent)
+			{
+				double draw = static_cast<double>(next_random(state) >> 11) / 9007199254740992.0;
+				size_t hot = std::lower_bound(workload.cdf.begin(), workload.cdf.end(), draw) - workload.cdf.begin();
+				filenames.push_back(hot_file(std::min(hot, workload.cdf.size() - 1)));
+			}
+			else
+			{
+				filenames.push_back(cold_file(worker.id, cold_count++));
+			}
+		}
+		set_files(*worker.ad, filenames);
+
+		Value val;
+		uint64_t start = monotonic_us();
+		bool ok = worker.ad->EvaluateAttr("sites", val) && val.IsListValue();
+		worker.latencies_us.push_back(monotonic_us() - start);
+		if (!ok)
+			worker.errors++;
+	}
+	return NULL;
+}
+
+static unsigned int percentile(const std::vector<unsigned int> &sorted, unsigned int permille)
+{
+	if (sorted.empty())
+		return 0;
+	size_t idx = (sorted.size() * permille + 999) / 1000;
+	return sorted[idx ? idx - 1 : 0];
+}
+
+static void usage()
+{
+	std::cout << "Usage: ./classad_xrootd_mapping_bench [options] <loadable classad module filename>" << std::endl
+		<< "  -t threads      evaluating threads (default 4)" << std::endl
+		<< "  -n ops          evaluations per thread (default 10000)" << std::endl
+		<< "  -f files        files per ad (default 10)" << std::endl
+		<< "  -k files        files warmed into the cache beforehand (default 10000)" << std::endl
+		<< "  -h percent      share of the files drawn from the warm ones (default 90)" << std::endl
+		<< "  -z exponent     Zipf skew of those draws; 0 for uniform (default 0)" << std::endl
+		<< "  -l usec         fake redirector latency (default 2000)" << std::endl
+		<< "  -j usec         extra random latency, up to (default 1000)" << std::endl
+		<< "  -L percent      share of requests the fake redirector drops (default 0)" << std::endl
+		<< "  -s sites        servers files are spread over (default 50)" << std::endl
+		<< "  -r replicas     servers holding each file (default 3)" << std::endl
+		<< "  -m managers     managers the servers are split among, for CLASSAD_XROOTD_DEEP_LOCATE (default 0)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+
+	Workload workload;
+	workload.threads = 4;
+	workload.ops = 10000;
+	workload.files = 10;
+	workload.hot_files = 10000;
+	workload.hit_percent = 90;
+	workload.zipf = 0;
+	unsigned int latency_us = 2000, jitter_us = 1000, sites = 50, replicas = 3, managers = 0;
+	double loss_percent = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "t:n:f:k:h:z:l:j:L:s:r:m:")) != -1)
+	{
+		switch (opt)
+		{
+			case 't': workload.threads = atoi(optarg); break;
+			case 'n': workload.ops = atoi(optarg); break;
+			case 'f': workload.files = atoi(optarg); break;
+			case 'k': workload.hot_files = atoi(optarg); break;
+			case 'h': workload.hit_percent = atoi(optarg); break;
+			case 'z': workload.zipf = atof(optarg); break;
+			case 'l': latency_us = atoi(optarg); break;
+			case 'j': jitter_us = atoi(optarg); break;
+			case 'L': loss_percent = atof(optarg); break;
+			case 's': sites = atoi(optarg); break;
+			case 'r': replicas = atoi(optarg); break;
+			case 'm': managers = atoi(optarg); break;
+			default: usage(); return 1;
+		}
+	}
+	if (optind != argc - 1 || !workload.threads || !workload.files || !workload.hot_files)
+	{
+		usage();
+		return 1;
+	}
+	const char *module = argv[optind];
+
+	if (!FunctionCall::RegisterSharedLibraryFunctions(module))
+	{
+		std::cout << "Failed to load ClassAd user lib (" << module << "): " << classad::CondorErrMsg << std::endl;
+		return 1;
+	}
+	// The module is loaded already; this only looks up its hook.
+	void *handle = dlopen(module, RTLD_NOW);
+	SetBackendFunc set_backend = handle ? reinterpret_cast<SetBackendFunc>(dlsym(handle, "classad_xrootd_mapping_set_backend")) : NULL;
+	if (!set_backend)
+	{
+		std::cout << "Module " << module << " does not support a fake redirector." << std::endl;
+		return 1;
+	}
+	// Never deleted; the module keeps using them until the process exits.
+	set_backend(new FakeRedirector(latency_us, jitter_us, loss_percent / 100, sites, replicas, managers), new FakeResolver());
+
+	// Probability of drawing each warm file, by rank.
+	double total = 0;
+	workload.cdf.reserve(workload.hot_files);
+	for (unsigned int idx = 0; idx < workload.hot_files; idx++)
+	{
+		total += 1 / pow(static_cast<double>(idx + 1), workload.zipf);
+		workload.cdf.push_back(total);
+	}
+	for (std::vector<double>::iterator it = workload.cdf.begin(); it != workload.cdf.end(); ++it)
+	{
+		*it /= total;
+	}
+
+	// Hostnames resolve in the background, and answers naming a server
+	// not yet resolved are only cached briefly.  Learn every server first.
+	ClassAd *warm_ad = make_ad();
+	if (!warm_ad)
+	{
+		std::cout << "Unable to parse the benchmark ClassAd." << std::endl;
+		return 1;
+	}
+	std::vector<std::string> filenames;
+	for (unsigned int idx = 0; idx < 20*sites; idx++)
+	{
+		filenames.push_back(cold_file(workload.threads, idx));
+	}
+	Value val;
+	set_files(*warm_ad, filenames);
+	warm_ad->EvaluateAttr("sites", val);
+	XrdSysTimer::Wait(500);
+
+	uint64_t start = monotonic_us();
+	for (unsigned int first = 0; first < workload.hot_files; first += 1000)
+	{
+		filenames.clear();
+		for (unsigned int idx = first; idx < std::min(first + 1000, workload.hot_files); idx++)
+		{
+			filenames.push_back(hot_file(idx));
+		}
+		set_files(*warm_ad, filenames);
+		warm_ad->EvaluateAttr("sites", val);
+	}
+	std::cout << "Warmed " << workload.hot_files << " files in " << (monotonic_us() - start) / 1000 << " ms" << std::endl;
+
+	std::vector<Worker> workers(workload.threads);
+	std::vector<pthread_t> tids(workload.threads);
+	for (unsigned int idx = 0; idx < workload.threads; idx++)
+	{
+		workers[idx].workload = &workload;
+		workers[idx].id = idx;
+		workers[idx].ad = make_ad();
+		workers[idx].errors = 0;
+	}
+	start = monotonic_us();
+	for (unsigned int idx = 0; idx < workload.threads; idx++)
+	{
+		XrdSysThread::Run(&tids[idx], run_worker, &workers[idx], XRDSYSTHREAD_HOLD, "Benchmark worker");
+	}
+	std::vector<unsigned int> latencies_us;
+	unsigned int errors = 0;
+	for (unsigned int idx = 0; idx < workload.threads; idx++)
+	{
+		XrdSysThread::Join(tids[idx], NULL);
+		latencies_us.insert(latencies_us.end(), workers[idx].latencies_us.begin(), workers[idx].latencies_us.end());
+		errors += workers[idx].errors;
+		delete workers[idx].ad;
+	}
+	double elapsed = (monotonic_us() - start) / 1e6;
+	std::sort(latencies_us.begin(), latencies_us.end());
+
+	std::cout << "Evaluations: " << latencies_us.size() << " (" << errors << " failed) in " << elapsed << " s" << std::endl
+		<< "Throughput: " << latencies_us.size() / elapsed << " ops/s" << std::endl
+		<< "Latency (us): p50 " << percentile(latencies_us, 500)
+		<< ", p99 " << percentile(latencies_us, 990)
+		<< ", p999 " << percentile(latencies_us, 999)
+		<< ", max " << (latencies_us.empty() ? 0 : latencies_us.back()) << std::endl;
+
+	// The module's own view of the run.
+	ClassAdParser parser;
+	ClassAd *stats_ad = parser.ParseClassAd("[ stats = xrootd_mapping_stats() ]", true);
+	if (stats_ad && stats_ad->EvaluateAttr("stats", val))
+	{
+		std::string unparsed;
+		PrettyPrint pp;
+		pp.Unparse(unparsed, val);
+		std::cout << "Module statistics: " << unparsed << std::endl;
+	}
+	delete stats_ad;
+	delete warm_ad;
+
+	return errors ? 1 : 0;
+}
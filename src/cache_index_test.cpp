@@ -0,0 +1,191 @@
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "key_arena.h"
+#include "response_cache.h"
+#include "test_utils.h"
+
+using namespace ClassadXrootdMapping;
+
+// A fixed sequence, so that a failure can be reproduced.
+static unsigned int random_state = 12345;
+static unsigned int next_random()
+{
+	random_state = random_state * 1103515245 + 12345;
+	return (random_state >> 16) & 0x7fff;
+}
+
+template <typename T>
+static void shuffle(std::vector<T> &items)
+{
+	for (size_t idx = items.size(); idx > 1; idx--)
+	{
+		std::swap(items[idx - 1], items[next_random() % idx]);
+	}
+}
+
+static std::string make_prefix(unsigned int idx)
+{
+	// Long enough that releasing most of them compacts the arena.
+	std::stringstream prefix;
+	prefix << "1:/store/mc/RunIISummer/" << idx << "/" << std::string(idx % 100 + 50, 'x') << "/";
+	return prefix.str();
+}
+
+/*
+ * Releasing prefixes in any order must leave every other prefix findable,
+ * free the handles for reuse, and keep the survivors' characters intact
+ * when the buffer is compacted.
+ */
+static void test_arena()
+{
+	const unsigned int count = 3000;
+	PrefixArena arena;
+	std::vector<PrefixHandle> handles;
+	for (unsigned int idx = 0; idx < count; idx++)
+	{
+		std::string prefix = make_prefix(idx);
+		handles.push_back(arena.acquire(prefix.data(), prefix.size()));
+	}
+	// A second reference to every third prefix.
+	for (unsigned int idx = 0; idx < count; idx += 3)
+	{
+		std::string prefix = make_prefix(idx);
+		check(arena.acquire(prefix.data(), prefix.size()) == handles[idx], "second acquire of " + prefix);
+	}
+	size_t full_bytes = arena.bytes();
+
+	// Drop every prefix's first reference, in random order; two thirds go.
+	std::vector<unsigned int> order;
+	for (unsigned int idx = 0; idx < count; idx++)
+	{
+		order.push_back(idx);
+	}
+	shuffle(order);
+	for (std::vector<unsigned int>::const_iterator it = order.begin(); it != order.end(); ++it)
+	{
+		arena.release(handles[*it]);
+	}
+	check(arena.bytes() < full_bytes / 2, "released prefixes are not counted");
+
+	// The survivors are still found where they were, with their characters.
+	for (unsigned int idx = 0; idx < count; idx += 3)
+	{
+		std::string prefix = make_prefix(idx);
+		check(std::string(arena.data(handles[idx]), arena.length(handles[idx])) == prefix, "contents of " + prefix);
+		check(arena.acquire(prefix.data(), prefix.size()) == handles[idx], "lookup of " + prefix);
+		arena.release(handles[idx]);
+	}
+
+	// Released prefixes are gone; adding them back reuses the free handles.
+	for (unsigned int idx = 1; idx < count; idx += 3)
+	{
+		std::string prefix = make_prefix(idx);
+		PrefixHandle handle = arena.acquire(prefix.data(), prefix.size());
+		check(handle < count, "handle reused for " + prefix);
+		check(std::string(arena.data(handle), arena.length(handle)) == prefix, "contents of re-added " + prefix);
+		for (unsigned int other = 0; other < count; other += 3)
+		{
+			check(handle != handles[other], "re-added " + prefix + " shares a live handle");
+		}
+	}
+}
+
+static std::string make_filename(unsigned int idx)
+{
+	// A few directories, so entries share prefixes.
+	std::stringstream filename;
+	filename << "/store/data/run" << idx % 7 << "/file" << idx << ".root";
+	return filename.str();
+}
+
+static bool cached(const CacheShard &shard, unsigned int idx)
+{
+	std::string key = CacheEntry::makeKey(1, make_filename(idx));
+	return shard.find(key.data(), key.size()) != NULL;
+}
+
+/*
+ * Entries leave a shard's index as they expire, in an order unrelated to
+ * where they were hashed, and as they are evicted; each time, every entry
+ * still counted must be found and no removed one may be.
+ */
+static void test_index()
+{
+	const unsigned int count = 4000;
+	const time_t start = 100000;
+	const size_t unlimited = static_cast<size_t>(-1);
+	CacheShard shard;
+	HostSet hosts;
+
+	std::vector<time_t> expiration;
+	for (unsigned int idx = 0; idx < count; idx++)
+	{
+		unsigned int lifetime = 1 + next_random() % 60;
+		shard.insert(CacheEntry::makeKey(1, make_filename(idx)), LookupNotFound, hosts, start, lifetime, 60, unlimited);
+		expiration.push_back(start + lifetime);
+	}
+	check(shard.size() == count, "all entries inserted");
+
+	for (time_t now = start + 1; now <= start + 60; now++)
+	{
+		shard.expire(now, now);
+		size_t live = 0;
+		for (unsigned int idx = 0; idx < count; idx++)
+		{
+			bool expected = expiration[idx] > now;
+			if (cached(shard, idx) != expected)
+			{
+				std::stringstream what;
+				what << make_filename(idx) << (expected ? " lost" : " kept") << " at second " << now - start;
+				check(false, what.str());
+			}
+			live += expected;
+		}
+		check(shard.size() == live, "size after expiry");
+	}
+	check(shard.size() == 0, "all entries expired");
+
+	// Fill again, then shrink the budget so most entries are evicted.
+	for (unsigned int idx = 0; idx < count; idx++)
+	{
+		shard.insert(CacheEntry::makeKey(1, make_filename(idx)), LookupNotFound, hosts, start, 60, 60, unlimited);
+	}
+	size_t full_bytes = shard.bytes();
+	std::vector<unsigned int> order;
+	for (unsigned int idx = 0; idx < count; idx++)
+	{
+		order.push_back(idx);
+	}
+	shuffle(order);
+	for (unsigned int budget = 4; budget > 0; budget--)
+	{
+		// Each insert evicts down to the budget; use a file not yet cached.
+		shard.insert(CacheEntry::makeKey(1, make_filename(count + budget)), LookupNotFound, hosts, start, 60, 60,
+			full_bytes / 5 * budget);
+		check(shard.bytes() <= full_bytes / 5 * budget, "evicted to the budget");
+
+		size_t found = 0;
+		for (std::vector<unsigned int>::const_iterator it = order.begin(); it != order.end(); ++it)
+		{
+			found += cached(shard, *it);
+		}
+		for (unsigned int idx = count + budget; idx <= count + 4; idx++)
+		{
+			found += cached(shard, idx);
+		}
+		std::stringstream what;
+		what << "found " << found << " of " << shard.size() << " entries left in a budget of " << budget << "/5";
+		check(found == shard.size(), what.str());
+	}
+}
+
+int main() {
+
+	test_arena();
+	test_index();
+
+	return finishTests("cache index");
+}
@@ -0,0 +1,274 @@
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache_snapshot.h"
+
+using namespace ClassadXrootdMapping;
+
+const char MappedSnapshot::m_magic[8] = {'C', 'X', 'M', 'S', 'N', 'A', 'P', '\0'};
+
+MappedSnapshot::MappedSnapshot(const char *base, size_t size) :
+	m_base(base),
+	m_size(size),
+	m_header(reinterpret_cast<const SnapshotHeader *>(base)),
+	m_records(reinterpret_cast<const SnapshotRecord *>(base + m_header->m_records_offset)),
+	m_ids(reinterpret_cast<const uint32_t *>(base + m_header->m_ids_offset)),
+	m_strings(base + m_header->m_strings_offset)
+{
+}
+
+MappedSnapshot::~MappedSnapshot()
+{
+	munmap(const_cast<char *>(m_base), m_size);
+}
+
+MappedSnapshot *
+MappedSnapshot::open(const std::string &path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < static_cast<off_t>(sizeof(SnapshotHeader)))
+	{
+		close(fd);
+		return NULL;
+	}
+	size_t size = st.st_size;
+	void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	// Every section must lie within the file, in order.
+	const char *base = static_cast<const char *>(addr);
+	const SnapshotHeader &header = *reinterpret_cast<const SnapshotHeader *>(base);
+	if (memcmp(header.m_magic, m_magic, sizeof(m_magic)) ||
+		header.m_version != m_version ||
+		header.m_file_size != size ||
+		header.m_hosts_offset < sizeof(SnapshotHeader) ||
+		header.m_host_count > size / sizeof(SnapshotHost) ||
+		header.m_redirector_count > size / sizeof(SnapshotHost) ||
+		header.m_entry_count > size / sizeof(SnapshotRecord) ||
+		header.m_redirectors_offset < header.m_hosts_offset + header.m_host_count*sizeof(SnapshotHost) ||
+		header.m_records_offset < header.m_redirectors_offset + header.m_redirector_count*sizeof(SnapshotHost) ||
+		header.m_records_offset % sizeof(uint64_t) ||
+		header.m_ids_offset < header.m_records_offset + header.m_entry_count*sizeof(SnapshotRecord) ||
+		header.m_strings_offset < header.m_ids_offset ||
+		header.m_strings_offset > size)
+	{
+		munmap(addr, size);
+		return NULL;
+	}
+
+	MappedSnapshot *snapshot = new MappedSnapshot(base, size);
+
+	// The file has its own host IDs; only hostnames are stable across processes.
+	HostTable &host_table = HostTable::getInstance();
+	const SnapshotHost *hosts = reinterpret_cast<const SnapshotHost *>(base + header.m_hosts_offset);
+	size_t strings_size = size - header.m_strings_offset;
+	snapshot->m_host_ids.reserve(header.m_host_count);
+	for (uint32_t idx = 0; idx < header.m_host_count; idx++)
+	{
+		HostId id;
+		if (static_cast<uint64_t>(hosts[idx].m_name_offset) + hosts[idx].m_name_length > strings_size ||
+			!host_table.intern(std::string(snapshot->m_strings + hosts[idx].m_name_offset, hosts[idx].m_name_length), id))
+		{
+			delete snapshot;
+			return NULL;
+		}
+		snapshot->m_host_ids.push_back(id);
+	}
+
+	// Likewise for redirectors, but lookups go the other way.
+	HostTable &redirector_table = HostTable::getRedirectorTable();
+	const SnapshotHost *redirectors = reinterpret_cast<const SnapshotHost *>(base + header.m_redirectors_offset);
+	for (uint32_t idx = 0; idx < header.m_redirector_count; idx++)
+	{
+		RedirectorId id;
+		if (static_cast<uint64_t>(redirectors[idx].m_name_offset) + redirectors[idx].m_name_length > strings_size ||
+			!redirector_table.intern(std::string(snapshot->m_strings + redirectors[idx].m_name_offset, redirectors[idx].m_name_length), id))
+		{
+			delete snapshot;
+			return NULL;
+		}
+		snapshot->m_redirector_ids[id] = idx;
+	}
+	return snapshot;
+}
+
+bool
+MappedSnapshot::lookup(RedirectorId redirector, const std::string &filename, LookupOutcome &outcome, time_t &expiration, HostSet &hosts) const
+{
+	classad_unordered<RedirectorId, uint32_t>::const_iterator redirector_it = m_redirector_ids.find(redirector);
+	if (redirector_it == m_redirector_ids.end())
+		return false;
+	uint32_t file_redirector = redirector_it->second;
+
+	uint64_t strings_size = m_size - m_header->m_strings_offset;
+	uint64_t ids_size = (m_header->m_strings_offset - m_header->m_ids_offset) / sizeof(uint32_t);
+
+	uint64_t low = 0, high = m_header->m_entry_count;
+	while (low < high)
+	{
+		uint64_t mid = low + (high - low) / 2;
+		const SnapshotRecord &record = m_records[mid];
+		if (record.m_name_offset + record.m_name_length > strings_size)
+			return false;
+
+		int cmp = (file_redirector < record.m_redirector) ? -1 :
+			(file_redirector > record.m_redirector) ? 1 :
+			filename.compare(0, filename.size(), m_strings + record.m_name_offset, record.m_name_length);
+		if (cmp < 0)
+		{
+			high = mid;
+			continue;
+		}
+		if (cmp > 0)
+		{
+			low = mid + 1;
+			continue;
+		}
+
+		if (record.m_outcome > LookupTimedOut ||
+			static_cast<uint64_t>(record.m_ids_index) + record.m_ids_count > ids_size)
+			return false;
+		for (uint32_t idx = record.m_ids_index; idx < record.m_ids_index + record.m_ids_count; idx++)
+		{
+			if (m_ids[idx] >= m_host_ids.size())
+				return false;
+			hosts.insert(m_host_ids[m_ids[idx]]);
+		}
+		outcome = static_cast<LookupOutcome>(record.m_outcome);
+		expiration = record.m_expiration;
+		return true;
+	}
+	return false;
+}
+
+bool
+MappedSnapshot::write(const std::string &path, std::vector<SnapshotItem> &items)
+{
+	std::sort(items.begin(), items.end());
+
+	std::vector<SnapshotHost> hosts;
+	std::vector<int64_t> file_host_ids; // Process host ID -> file host ID, or -1.
+	std::string host_strings;
+	// The items are sorted by process redirector ID, so numbering the
+	// redirectors as they appear keeps the records sorted by file ID.
+	std::vector<SnapshotHost> redirectors;
+	std::string redirector_strings;
+	std::vector<SnapshotRecord> records;
+	std::vector<uint32_t> ids;
+	std::string name_strings;
+	int64_t max_expiration = 0;
+
+	records.reserve(items.size());
+	std::vector<HostId> item_ids;
+	for (std::vector<SnapshotItem>::const_iterator it = items.begin(); it != items.end(); ++it)
+	{
+		SnapshotRecord record;
+		memset(&record, 0, sizeof(record));
+		record.m_name_offset = name_strings.size();
+		record.m_name_length = it->m_filename.size();
+		record.m_ids_index = ids.size();
+		record.m_expiration = it->m_expiration;
+		record.m_outcome = it->m_outcome;
+		name_strings += it->m_filename;
+
+		if (it == items.begin() || it->m_redirector != (it - 1)->m_redirector)
+		{
+			const std::string &name = HostTable::getRedirectorTable().getName(it->m_redirector);
+			SnapshotHost redirector;
+			redirector.m_name_offset = redirector_strings.size();
+			redirector.m_name_length = name.size();
+			redirector_strings += name;
+			redirectors.push_back(redirector);
+		}
+		record.m_redirector = redirectors.size() - 1;
+
+		item_ids.clear();
+		it->m_hosts.getIds(item_ids);
+		record.m_ids_count = item_ids.size();
+		for (std::vector<HostId>::const_iterator id_it = item_ids.begin(); id_it != item_ids.end(); ++id_it)
+		{
+			if (*id_it >= file_host_ids.size())
+				file_host_ids.resize(*id_it + 1, -1);
+			if (file_host_ids[*id_it] < 0)
+			{
+				const std::string &name = HostTable::getInstance().getName(*id_it);
+				SnapshotHost host;
+				host.m_name_offset = host_strings.size();
+				host.m_name_length = name.size();
+				host_strings += name;
+				file_host_ids[*id_it] = hosts.size();
+				hosts.push_back(host);
+			}
+			ids.push_back(file_host_ids[*id_it]);
+		}
+		records.push_back(record);
+		max_expiration = std::max(max_expiration, static_cast<int64_t>(it->m_expiration));
+	}
+	// Redirectors follow the hostnames in the strings section, then the filenames.
+	for (std::vector<SnapshotHost>::iterator it = redirectors.begin(); it != redirectors.end(); ++it)
+	{
+		it->m_name_offset += host_strings.size();
+	}
+	for (std::vector<SnapshotRecord>::iterator it = records.begin(); it != records.end(); ++it)
+	{
+		it->m_name_offset += host_strings.size() + redirector_strings.size();
+	}
+
+	SnapshotHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.m_magic, m_magic, sizeof(m_magic));
+	header.m_version = m_version;
+	header.m_host_count = hosts.size();
+	header.m_entry_count = records.size();
+	header.m_max_expiration = max_expiration;
+	header.m_redirector_count = redirectors.size();
+	header.m_hosts_offset = sizeof(SnapshotHeader);
+	header.m_redirectors_offset = header.m_hosts_offset + hosts.size()*sizeof(SnapshotHost);
+	header.m_records_offset = header.m_redirectors_offset + redirectors.size()*sizeof(SnapshotHost);
+	// Keep the records 8-byte aligned.
+	header.m_records_offset = (header.m_records_offset + 7) & ~static_cast<uint64_t>(7);
+	header.m_ids_offset = header.m_records_offset + records.size()*sizeof(SnapshotRecord);
+	header.m_strings_offset = header.m_ids_offset + ids.size()*sizeof(uint32_t);
+	header.m_file_size = header.m_strings_offset + host_strings.size() + redirector_strings.size() + name_strings.size();
+
+	// Write aside and rename, so readers never see a partial file.
+	char pid[32];
+	snprintf(pid, sizeof(pid), ".%d", static_cast<int>(getpid()));
+	std::string tmp_path = path + ".tmp" + pid;
+	FILE *fp = fopen(tmp_path.c_str(), "w");
+	if (!fp)
+		return false;
+
+	static const char padding[8] = {0};
+	uint64_t names_end = header.m_redirectors_offset + redirectors.size()*sizeof(SnapshotHost);
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	ok = ok && (hosts.empty() || fwrite(&hosts[0], sizeof(SnapshotHost), hosts.size(), fp) == hosts.size());
+	ok = ok && (redirectors.empty() || fwrite(&redirectors[0], sizeof(SnapshotHost), redirectors.size(), fp) == redirectors.size());
+	ok = ok && fwrite(padding, 1, header.m_records_offset - names_end, fp) == header.m_records_offset - names_end;
+	ok = ok && (records.empty() || fwrite(&records[0], sizeof(SnapshotRecord), records.size(), fp) == records.size());
+	ok = ok && (ids.empty() || fwrite(&ids[0], sizeof(uint32_t), ids.size(), fp) == ids.size());
+	ok = ok && fwrite(host_strings.data(), 1, host_strings.size(), fp) == host_strings.size();
+	ok = ok && fwrite(redirector_strings.data(), 1, redirector_strings.size(), fp) == redirector_strings.size();
+	ok = ok && fwrite(name_strings.data(), 1, name_strings.size(), fp) == name_strings.size();
+	ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+	ok = (fclose(fp) == 0) && ok;
+
+	if (!ok || rename(tmp_path.c_str(), path.c_str()))
+	{
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
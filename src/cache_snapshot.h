@@ -0,0 +1,110 @@
+#ifndef __CACHESNAPSHOT_H_
+#define __CACHESNAPSHOT_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "host_table.h"
+#include "response_cache.h"
+
+namespace ClassadXrootdMapping {
+
+/*
+ * On-disk image of the response cache, so a restarted process can serve
+ * still-valid answers immediately.  The file is memory-mapped and searched
+ * in place; nothing is loaded up front.
+ *
+ * Layout (native byte order; the file is only read by the host writing it):
+ *   SnapshotHeader
+ *   SnapshotHost[m_host_count]     - hostnames; the file's own dense host IDs
+ *   SnapshotHost[m_redirector_count] - redirectors; the file's own redirector IDs
+ *   SnapshotRecord[m_entry_count]  - sorted by redirector ID, then filename
+ *   uint32_t[]                     - host IDs referenced by the records
+ *   char[]                         - hostnames, redirectors and filenames
+ */
+struct SnapshotHeader {
+	char m_magic[8];
+	uint32_t m_version;
+	uint32_t m_host_count;
+	uint64_t m_entry_count;
+	uint64_t m_file_size;
+	int64_t m_max_expiration;
+	uint64_t m_hosts_offset;
+	uint32_t m_redirector_count;
+	uint32_t m_padding;
+	uint64_t m_redirectors_offset;
+	uint64_t m_records_offset;
+	uint64_t m_ids_offset;
+	uint64_t m_strings_offset;
+};
+
+struct SnapshotHost {
+	uint32_t m_name_offset; // Relative to the strings section.
+	uint32_t m_name_length;
+};
+
+struct SnapshotRecord {
+	uint64_t m_name_offset; // Relative to the strings section.
+	uint32_t m_name_length;
+	uint32_t m_ids_index;
+	int64_t m_expiration;
+	uint32_t m_redirector;
+	uint16_t m_ids_count;
+	uint8_t m_outcome;
+	uint8_t m_padding;
+};
+
+/*
+ * One valid cache entry, as copied out of the cache for writing.
+ */
+struct SnapshotItem {
+	RedirectorId m_redirector;
+	std::string m_filename;
+	LookupOutcome m_outcome;
+	time_t m_expiration;
+	HostSet m_hosts;
+
+	bool operator<(const SnapshotItem &other) const
+	{
+		return m_redirector < other.m_redirector ||
+			(m_redirector == other.m_redirector && m_filename < other.m_filename);
+	}
+};
+
+class MappedSnapshot {
+
+public:
+
+	// Returns NULL if the file is missing, unreadable, or not a snapshot.
+	static MappedSnapshot *open(const std::string &path);
+
+	// Sorts the items and atomically replaces the file at `path`.
+	static bool write(const std::string &path, std::vector<SnapshotItem> &items);
+
+	bool lookup(RedirectorId redirector, const std::string &filename, LookupOutcome &outcome, time_t &expiration, HostSet &hosts) const;
+
+	time_t getMaxExpiration() const { return m_header->m_max_expiration; }
+
+	~MappedSnapshot();
+
+private:
+
+	MappedSnapshot(const char *base, size_t size);
+
+	static const char m_magic[8];
+	static const uint32_t m_version = 2;
+
+	const char *m_base;
+	size_t m_size;
+	const SnapshotHeader *m_header;
+	const SnapshotRecord *m_records;
+	const uint32_t *m_ids;
+	const char *m_strings;
+	std::vector<HostId> m_host_ids; // File host ID -> process host ID.
+	classad_unordered<RedirectorId, uint32_t> m_redirector_ids; // Process redirector ID -> file redirector ID.
+};
+
+}
+
+#endif
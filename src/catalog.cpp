@@ -0,0 +1,359 @@
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "catalog.h"
+
+using namespace ClassadXrootdMapping;
+
+const char MappedCatalog::m_magic[8] = {'C', 'X', 'M', 'C', 'A', 'T', 'L', 'G'};
+
+static inline bool read_varint(const unsigned char *&pos, const unsigned char *end, uint64_t &value)
+{
+	value = 0;
+	for (unsigned int shift = 0; shift < 64 && pos < end; shift += 7)
+	{
+		unsigned char byte = *pos++;
+		value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static void write_varint(std::string &out, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		out += static_cast<char>((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	out += static_cast<char>(value);
+}
+
+MappedCatalog::MappedCatalog(const char *base, size_t size) :
+	m_base(base),
+	m_size(size),
+	m_header(reinterpret_cast<const CatalogHeader *>(base)),
+	m_blocks(reinterpret_cast<const uint64_t *>(base + m_header->m_blocks_offset)),
+	m_ids(reinterpret_cast<const uint32_t *>(base + m_header->m_ids_offset)),
+	m_entries(reinterpret_cast<const unsigned char *>(base + m_header->m_entries_offset)),
+	m_ids_count((m_header->m_strings_offset - m_header->m_ids_offset) / sizeof(uint32_t)),
+	m_entries_size(size - m_header->m_entries_offset)
+{
+}
+
+MappedCatalog::~MappedCatalog()
+{
+	munmap(const_cast<char *>(m_base), m_size);
+}
+
+MappedCatalog *
+MappedCatalog::open(const std::string &path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < static_cast<off_t>(sizeof(CatalogHeader)))
+	{
+		close(fd);
+		return NULL;
+	}
+	size_t size = st.st_size;
+	void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	// Every section must lie within the file, in order.
+	const char *base = static_cast<const char *>(addr);
+	const CatalogHeader &header = *reinterpret_cast<const CatalogHeader *>(base);
+	if (memcmp(header.m_magic, m_magic, sizeof(m_magic)) ||
+		header.m_version != m_version ||
+		header.m_file_size != size ||
+		header.m_hosts_offset < sizeof(CatalogHeader) ||
+		header.m_host_count > size / sizeof(CatalogHost) ||
+		header.m_block_count > size / sizeof(uint64_t) ||
+		header.m_blocks_offset < header.m_hosts_offset + header.m_host_count*sizeof(CatalogHost) ||
+		header.m_blocks_offset % sizeof(uint64_t) ||
+		header.m_ids_offset < header.m_blocks_offset + header.m_block_count*sizeof(uint64_t) ||
+		header.m_strings_offset < header.m_ids_offset ||
+		header.m_entries_offset < header.m_strings_offset ||
+		header.m_entries_offset > size)
+	{
+		munmap(addr, size);
+		return NULL;
+	}
+
+	MappedCatalog *catalog = new MappedCatalog(base, size);
+
+	// The file has its own host IDs; only hostnames are stable across processes.
+	HostTable &host_table = HostTable::getInstance();
+	const CatalogHost *hosts = reinterpret_cast<const CatalogHost *>(base + header.m_hosts_offset);
+	const char *strings = base + header.m_strings_offset;
+	size_t strings_size = header.m_entries_offset - header.m_strings_offset;
+	catalog->m_host_ids.reserve(header.m_host_count);
+	for (uint32_t idx = 0; idx < header.m_host_count; idx++)
+	{
+		HostId id;
+		if (static_cast<uint64_t>(hosts[idx].m_name_offset) + hosts[idx].m_name_length > strings_size ||
+			!host_table.intern(std::string(strings + hosts[idx].m_name_offset, hosts[idx].m_name_length), id))
+		{
+			delete catalog;
+			return NULL;
+		}
+		catalog->m_host_ids.push_back(id);
+	}
+	return catalog;
+}
+
+bool
+MappedCatalog::blockKey(uint64_t block, const char *&key, uint64_t &length) const
+{
+	if (m_blocks[block] >= m_entries_size)
+		return false;
+	const unsigned char *pos = m_entries + m_blocks[block];
+	const unsigned char *end = m_entries + m_entries_size;
+	uint64_t shared;
+	if (!read_varint(pos, end, shared) || shared || !read_varint(pos, end, length) ||
+		length > static_cast<uint64_t>(end - pos))
+		return false;
+	key = reinterpret_cast<const char *>(pos);
+	return true;
+}
+
+bool
+MappedCatalog::lookup(const std::string &filename, HostSet &hosts) const
+{
+	// Find the last block starting at or before the filename.
+	uint64_t low = 0, high = m_header->m_block_count;
+	while (low < high)
+	{
+		uint64_t mid = low + (high - low) / 2;
+		const char *key;
+		uint64_t length;
+		if (!blockKey(mid, key, length))
+			return false;
+		if (filename.compare(0, filename.size(), key, length) < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	if (low == 0)
+		return false;
+	uint64_t block = low - 1;
+	uint64_t block_end = (block + 1 < m_header->m_block_count) ? m_blocks[block + 1] : m_entries_size;
+	if (block_end > m_entries_size || block_end < m_blocks[block])
+		return false;
+
+	// Walk the block, tracking how much of the filename the previous entry
+	// matched; a front-coded entry can often be ruled out from its shared
+	// prefix length alone.
+	const unsigned char *pos = m_entries + m_blocks[block];
+	const unsigned char *end = m_entries + block_end;
+	const unsigned char *name = reinterpret_cast<const unsigned char *>(filename.data());
+	uint64_t name_length = filename.size();
+	uint64_t matched = 0;
+	while (pos < end)
+	{
+		uint64_t shared, length, ids_index, ids_count;
+		if (!read_varint(pos, end, shared) || !read_varint(pos, end, length) ||
+			length > static_cast<uint64_t>(end - pos))
+			return false;
+		const unsigned char *suffix = pos;
+		pos += length;
+		if (!read_varint(pos, end, ids_index) || !read_varint(pos, end, ids_count))
+			return false;
+
+		// Agrees with the previous entry past where that one left the
+		// filename, so it sorts before the filename too.
+		if (shared > matched)
+			continue;
+		// Differs from the previous entry where that one still agreed with
+		// the filename, so it sorts after it; so does everything else.
+		if (shared < matched)
+			return false;
+
+		uint64_t idx = 0;
+		while (idx < length && matched + idx < name_length && suffix[idx] == name[matched + idx])
+			idx++;
+		matched += idx;
+		if (idx < length)
+		{
+			if (matched == name_length || suffix[idx] > name[matched])
+				return false;
+			continue;
+		}
+		if (matched < name_length)
+			continue;
+
+		if (ids_index > m_ids_count || ids_count > m_ids_count - ids_index)
+			return false;
+		for (uint64_t id = ids_index; id < ids_index + ids_count; id++)
+		{
+			if (m_ids[id] >= m_host_ids.size())
+				return false;
+		}
+		for (uint64_t id = ids_index; id < ids_index + ids_count; id++)
+		{
+			hosts.insert(m_host_ids[m_ids[id]]);
+		}
+		return true;
+	}
+	return false;
+}
+
+bool
+MappedCatalog::write(const std::string &path, std::istream &input, std::string &error)
+{
+	typedef std::vector<uint32_t> IdList;
+	std::vector<std::pair<std::string, IdList> > files;
+	std::map<std::string, uint32_t> host_ids;
+	std::vector<std::string> host_names;
+
+	std::string line;
+	unsigned long line_number = 0;
+	while (std::getline(input, line))
+	{
+		line_number++;
+		std::istringstream fields(line);
+		std::string filename, hostname;
+		if (!(fields >> filename) || filename[0] == '#')
+			continue;
+		files.push_back(std::make_pair(filename, IdList()));
+		while (fields >> hostname)
+		{
+			std::map<std::string, uint32_t>::const_iterator it = host_ids.find(hostname);
+			if (it == host_ids.end())
+			{
+				it = host_ids.insert(std::make_pair(hostname, static_cast<uint32_t>(host_names.size()))).first;
+				host_names.push_back(hostname);
+			}
+			files.back().second.push_back(it->second);
+		}
+	}
+	if (input.bad())
+	{
+		std::stringstream message;
+		message << "Read error after line " << line_number;
+		error = message.str();
+		return false;
+	}
+
+	// A file listed twice is at every host given for it.
+	std::sort(files.begin(), files.end());
+	std::vector<std::pair<std::string, IdList> >::iterator out = files.begin();
+	for (std::vector<std::pair<std::string, IdList> >::iterator it = files.begin(); it != files.end(); ++it)
+	{
+		if (out != files.begin() && (out - 1)->first == it->first)
+		{
+			(out - 1)->second.insert((out - 1)->second.end(), it->second.begin(), it->second.end());
+			continue;
+		}
+		if (out != it)
+		{
+			out->first.swap(it->first);
+			out->second.swap(it->second);
+		}
+		++out;
+	}
+	files.erase(out, files.end());
+
+	// Files in one dataset tend to sit at the same hosts; store each list once.
+	std::map<IdList, uint32_t> lists;
+	std::vector<uint32_t> ids;
+	std::vector<uint64_t> blocks;
+	std::string entries;
+	for (size_t idx = 0; idx < files.size(); idx++)
+	{
+		IdList &file_ids = files[idx].second;
+		std::sort(file_ids.begin(), file_ids.end());
+		file_ids.erase(std::unique(file_ids.begin(), file_ids.end()), file_ids.end());
+		std::map<IdList, uint32_t>::const_iterator list = lists.find(file_ids);
+		if (list == lists.end())
+		{
+			list = lists.insert(std::make_pair(file_ids, static_cast<uint32_t>(ids.size()))).first;
+			ids.insert(ids.end(), file_ids.begin(), file_ids.end());
+		}
+
+		const std::string &filename = files[idx].first;
+		size_t shared = 0;
+		if (idx % m_block_size == 0)
+		{
+			blocks.push_back(entries.size());
+		}
+		else
+		{
+			const std::string &previous = files[idx - 1].first;
+			while (shared < previous.size() && shared < filename.size() && previous[shared] == filename[shared])
+				shared++;
+		}
+		write_varint(entries, shared);
+		write_varint(entries, filename.size() - shared);
+		entries.append(filename, shared, std::string::npos);
+		write_varint(entries, list->second);
+		write_varint(entries, file_ids.size());
+	}
+
+	std::vector<CatalogHost> hosts;
+	std::string host_strings;
+	for (std::vector<std::string>::const_iterator it = host_names.begin(); it != host_names.end(); ++it)
+	{
+		CatalogHost host;
+		host.m_name_offset = host_strings.size();
+		host.m_name_length = it->size();
+		host_strings += *it;
+		hosts.push_back(host);
+	}
+
+	CatalogHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.m_magic, m_magic, sizeof(m_magic));
+	header.m_version = m_version;
+	header.m_host_count = hosts.size();
+	header.m_entry_count = files.size();
+	header.m_block_count = blocks.size();
+	header.m_hosts_offset = sizeof(CatalogHeader);
+	header.m_blocks_offset = header.m_hosts_offset + hosts.size()*sizeof(CatalogHost);
+	header.m_ids_offset = header.m_blocks_offset + blocks.size()*sizeof(uint64_t);
+	header.m_strings_offset = header.m_ids_offset + ids.size()*sizeof(uint32_t);
+	header.m_entries_offset = header.m_strings_offset + host_strings.size();
+	header.m_file_size = header.m_entries_offset + entries.size();
+
+	// Write aside and rename, so readers never see a partial file.
+	char pid[32];
+	snprintf(pid, sizeof(pid), ".%d", static_cast<int>(getpid()));
+	std::string tmp_path = path + ".tmp" + pid;
+	FILE *fp = fopen(tmp_path.c_str(), "w");
+	if (!fp)
+	{
+		error = "Unable to create " + tmp_path;
+		return false;
+	}
+
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	ok = ok && (hosts.empty() || fwrite(&hosts[0], sizeof(CatalogHost), hosts.size(), fp) == hosts.size());
+	ok = ok && (blocks.empty() || fwrite(&blocks[0], sizeof(uint64_t), blocks.size(), fp) == blocks.size());
+	ok = ok && (ids.empty() || fwrite(&ids[0], sizeof(uint32_t), ids.size(), fp) == ids.size());
+	ok = ok && fwrite(host_strings.data(), 1, host_strings.size(), fp) == host_strings.size();
+	ok = ok && fwrite(entries.data(), 1, entries.size(), fp) == entries.size();
+	ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+	ok = (fclose(fp) == 0) && ok;
+
+	if (!ok || rename(tmp_path.c_str(), path.c_str()))
+	{
+		unlink(tmp_path.c_str());
+		error = "Unable to write " + path;
+		return false;
+	}
+	return true;
+}
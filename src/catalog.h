@@ -0,0 +1,94 @@
+#ifndef __CATALOG_H_
+#define __CATALOG_H_
+
+#include <istream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "host_table.h"
+
+namespace ClassadXrootdMapping {
+
+/*
+ * Static file -> hosts map compiled from a data-management catalog dump.
+ * Like the cache snapshot, the file is memory-mapped and searched in place.
+ *
+ * Layout (native byte order):
+ *   CatalogHeader
+ *   CatalogHost[m_host_count]  - hostnames; the file's own dense host IDs
+ *   uint64_t[m_block_count]    - offset of each block in the entries section
+ *   uint32_t[]                 - host ID lists referenced by the entries
+ *   char[]                     - hostnames
+ *   uint8_t[]                  - entries, sorted by filename
+ *
+ * Entries are front-coded in blocks of m_block_size: each is the varint
+ * length of the prefix it shares with the previous filename, the varint
+ * length of the rest, the rest, and the varint index and count of its
+ * host IDs.  The first entry of a block shares nothing, so blocks can be
+ * binary searched by their first filename.
+ */
+struct CatalogHeader {
+	char m_magic[8];
+	uint32_t m_version;
+	uint32_t m_host_count;
+	uint64_t m_entry_count;
+	uint64_t m_file_size;
+	uint64_t m_hosts_offset;
+	uint64_t m_blocks_offset;
+	uint64_t m_block_count;
+	uint64_t m_ids_offset;
+	uint64_t m_strings_offset;
+	uint64_t m_entries_offset;
+};
+
+struct CatalogHost {
+	uint32_t m_name_offset; // Relative to the strings section.
+	uint32_t m_name_length;
+};
+
+class MappedCatalog {
+
+public:
+
+	// Returns NULL if the file is missing, unreadable, or not a catalog.
+	static MappedCatalog *open(const std::string &path);
+
+	// Compiles lines of "filename host [host ...]" into a catalog at `path`,
+	// replacing it atomically.  Blank lines and lines starting with '#' are
+	// skipped.  Returns false, with a message in `error`, on failure.
+	static bool write(const std::string &path, std::istream &input, std::string &error);
+
+	// Adds the file's hosts; false if the catalog does not list the file.
+	// Does not allocate, beyond growing `hosts`.
+	bool lookup(const std::string &filename, HostSet &hosts) const;
+
+	uint64_t size() const { return m_header->m_entry_count; }
+
+	~MappedCatalog();
+
+private:
+
+	MappedCatalog(const char *base, size_t size);
+
+	// The first filename of a block, in place.
+	bool blockKey(uint64_t block, const char *&key, uint64_t &length) const;
+
+	static const char m_magic[8];
+	static const uint32_t m_version = 1;
+	static const unsigned int m_block_size = 16;
+
+	const char *m_base;
+	size_t m_size;
+	const CatalogHeader *m_header;
+	const uint64_t *m_blocks;
+	const uint32_t *m_ids;
+	const unsigned char *m_entries;
+	uint64_t m_ids_count;
+	uint64_t m_entries_size;
+	std::vector<HostId> m_host_ids; // File host ID -> process host ID.
+};
+
+}
+
+#endif
@@ -0,0 +1,40 @@
+
+#include <iostream>
+#include <fstream>
+#include <string>
+
+#include "catalog.h"
+
+using namespace ClassadXrootdMapping;
+
+int main(int argc, char* argv[]) {
+
+	if (argc != 3) {
+		std::cout << "Usage: ./classad_xrootd_mapping_catalog <catalog dump, one \"filename host [host ...]\" per line> <output catalog>" << std::endl;
+		return 1;
+	}
+
+	std::ifstream input(argv[1]);
+	if (!input)
+	{
+		std::cout << "Unable to open " << argv[1] << "." << std::endl;
+		return 1;
+	}
+
+	std::string error;
+	if (!MappedCatalog::write(argv[2], input, error))
+	{
+		std::cout << "Unable to compile the catalog: " << error << std::endl;
+		return 1;
+	}
+
+	MappedCatalog *catalog = MappedCatalog::open(argv[2]);
+	if (!catalog)
+	{
+		std::cout << "Unable to read back " << argv[2] << "." << std::endl;
+		return 1;
+	}
+	std::cout << "Wrote " << catalog->size() << " files to " << argv[2] << "." << std::endl;
+	delete catalog;
+	return 0;
+}
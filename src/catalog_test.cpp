@@ -0,0 +1,160 @@
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "catalog.h"
+#include "test_utils.h"
+
+using namespace ClassadXrootdMapping;
+
+// The hosts the catalog gives for a file, space-separated, or "absent".
+static std::string hosts_of(const MappedCatalog &catalog, const std::string &filename)
+{
+	HostSet hosts;
+	if (!catalog.lookup(filename, hosts))
+		return "absent";
+	std::vector<std::string> names;
+	hosts.getNames(names);
+	std::string result;
+	for (std::vector<std::string>::const_iterator it = names.begin(); it != names.end(); ++it)
+	{
+		if (it != names.begin())
+			result += " ";
+		result += *it;
+	}
+	return result;
+}
+
+static void expect(const MappedCatalog &catalog, const std::string &filename, const std::string &hosts)
+{
+	std::string found = hosts_of(catalog, filename);
+	check(found == hosts, filename + ": expected \"" + hosts + "\", got \"" + found + "\"");
+}
+
+static bool write_file(const std::string &path, const std::string &contents)
+{
+	FILE *fp = fopen(path.c_str(), "w");
+	if (!fp)
+		return false;
+	bool ok = fwrite(contents.data(), 1, contents.size(), fp) == contents.size();
+	return (fclose(fp) == 0) && ok;
+}
+
+static std::string read_file(const std::string &path)
+{
+	std::string contents;
+	FILE *fp = fopen(path.c_str(), "r");
+	if (!fp)
+		return contents;
+	char buffer[4096];
+	size_t count;
+	while ((count = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+		contents.append(buffer, count);
+	fclose(fp);
+	return contents;
+}
+
+int main() {
+
+	char pid[32];
+	snprintf(pid, sizeof(pid), ".%d", static_cast<int>(getpid()));
+	std::string path = std::string("/tmp/classad_xrootd_mapping_catalog_test") + pid;
+
+	// Forty files, so the entries span three blocks of sixteen.  Each is at
+	// the host named after its number modulo three.
+	std::stringstream dump;
+	dump << "# A comment, then a blank line" << std::endl << std::endl;
+	for (unsigned int idx = 0; idx < 40; idx++)
+	{
+		char filename[64];
+		snprintf(filename, sizeof(filename), "/store/data/file%02u.root", idx);
+		dump << filename << " host" << idx % 3 << ".example.org" << std::endl;
+	}
+	// A name that is a prefix of another, both in the last block.
+	dump << "/store/prefix/a host1.example.org" << std::endl;
+	dump << "/store/prefix/ab host2.example.org" << std::endl;
+	// A file listed twice, and a file listed without hosts.
+	dump << "/store/twice host0.example.org" << std::endl;
+	dump << "/store/twice   host2.example.org host0.example.org" << std::endl;
+	dump << "/store/nowhere" << std::endl;
+
+	std::string error;
+	check(MappedCatalog::write(path, dump, error), "write: " + error);
+	MappedCatalog *catalog = MappedCatalog::open(path);
+	check(catalog != NULL, "open");
+	if (!catalog)
+	{
+		unlink(path.c_str());
+		return finishTests("catalog");
+	}
+
+	// The duplicate lines count once.
+	check(catalog->size() == 44, "entry count");
+
+	// First and last entries of each block; entries are sorted by name.
+	expect(*catalog, "/store/data/file00.root", "host0.example.org");
+	expect(*catalog, "/store/data/file15.root", "host0.example.org");
+	expect(*catalog, "/store/data/file16.root", "host1.example.org");
+	expect(*catalog, "/store/data/file31.root", "host1.example.org");
+	expect(*catalog, "/store/data/file32.root", "host2.example.org");
+	expect(*catalog, "/store/twice", "host0.example.org host2.example.org");
+	for (unsigned int idx = 0; idx < 40; idx++)
+	{
+		char filename[64], hostname[64];
+		snprintf(filename, sizeof(filename), "/store/data/file%02u.root", idx);
+		snprintf(hostname, sizeof(hostname), "host%u.example.org", idx % 3);
+		expect(*catalog, filename, hostname);
+	}
+
+	expect(*catalog, "/store/prefix/a", "host1.example.org");
+	expect(*catalog, "/store/prefix/ab", "host2.example.org");
+	expect(*catalog, "/store/prefix/", "absent");
+	expect(*catalog, "/store/prefix/aa", "absent");
+	expect(*catalog, "/store/prefix/abc", "absent");
+
+	// Listed, but at no host.
+	expect(*catalog, "/store/nowhere", "");
+
+	// Before the first block, between blocks, within a block, and after
+	// the last one.
+	expect(*catalog, "/aaa", "absent");
+	expect(*catalog, "", "absent");
+	expect(*catalog, "/store/data/file15.root.1", "absent");
+	expect(*catalog, "/store/data/file15", "absent");
+	expect(*catalog, "/store/data/file20.rootx", "absent");
+	expect(*catalog, "/store/zzz", "absent");
+	delete catalog;
+
+	// Damaged files are refused rather than searched.
+	std::string contents = read_file(path);
+	check(write_file(path, contents.substr(0, contents.size() - 1)) && !MappedCatalog::open(path), "truncated file refused");
+	check(write_file(path, contents.substr(0, sizeof(CatalogHeader) / 2)) && !MappedCatalog::open(path), "partial header refused");
+	std::string bad_magic = contents;
+	bad_magic[0] = 'X';
+	check(write_file(path, bad_magic) && !MappedCatalog::open(path), "bad magic refused");
+	std::string bad_offsets = contents;
+	CatalogHeader header;
+	memcpy(&header, bad_offsets.data(), sizeof(header));
+	header.m_ids_offset = header.m_blocks_offset;
+	memcpy(&bad_offsets[0], &header, sizeof(header));
+	check(write_file(path, bad_offsets) && !MappedCatalog::open(path), "overlapping sections refused");
+	check(!MappedCatalog::open(path + ".missing"), "missing file");
+
+	// An empty dump makes an empty catalog.
+	std::stringstream empty;
+	check(MappedCatalog::write(path, empty, error), "write empty: " + error);
+	catalog = MappedCatalog::open(path);
+	check(catalog != NULL, "open empty");
+	if (catalog)
+	{
+		expect(*catalog, "/store/data/file00.root", "absent");
+		delete catalog;
+	}
+
+	unlink(path.c_str());
+	return finishTests("catalog");
+}
@@ -0,0 +1,95 @@
+
+#include <stdlib.h>
+
+#include "config.h"
+
+using namespace ClassadXrootdMapping;
+
+Config * Config::m_instance = NULL;
+pthread_once_t Config::m_instance_once = PTHREAD_ONCE_INIT;
+
+Config::Config()
+{
+	m_cache_bytes = static_cast<size_t>(getLong("CLASSAD_XROOTD_CACHE_MB", 256)) * 1024 * 1024;
+
+	m_found_ttl = getLong("CLASSAD_XROOTD_FOUND_TTL", 15*60);
+	m_found_max_ttl = getLong("CLASSAD_XROOTD_FOUND_MAX_TTL", m_found_ttl);
+	m_notfound_ttl = getLong("CLASSAD_XROOTD_NOTFOUND_TTL", 60);
+	m_notfound_max_ttl = getLong("CLASSAD_XROOTD_NOTFOUND_MAX_TTL", 15*60);
+	m_error_ttl = getLong("CLASSAD_XROOTD_ERROR_TTL", 5);
+	m_error_max_ttl = getLong("CLASSAD_XROOTD_ERROR_MAX_TTL", 2*60);
+	m_timeout_ttl = getLong("CLASSAD_XROOTD_TIMEOUT_TTL", 5);
+	m_timeout_max_ttl = getLong("CLASSAD_XROOTD_TIMEOUT_MAX_TTL", 60);
+
+	m_stale_grace = getLong("CLASSAD_XROOTD_STALE_GRACE", 5*60);
+
+	m_locate_timeout = getLong("CLASSAD_XROOTD_LOCATE_TIMEOUT", 30);
+	m_hedge_percent = getLong("CLASSAD_XROOTD_HEDGE_PERCENT", 25);
+	if (m_hedge_percent > 100)
+		m_hedge_percent = 100;
+	m_breaker_failures = getLong("CLASSAD_XROOTD_BREAKER_FAILURES", 5);
+	if (!m_breaker_failures)
+		m_breaker_failures = 1;
+	m_breaker_open = getLong("CLASSAD_XROOTD_BREAKER_OPEN", 30);
+	m_connections = getLong("CLASSAD_XROOTD_CONNECTIONS", 1);
+	if (!m_connections)
+		m_connections = 1;
+	m_client_idle = getLong("CLASSAD_XROOTD_CLIENT_IDLE", 10*60);
+	m_submit_window_us = getLong("CLASSAD_XROOTD_SUBMIT_WINDOW_US", 0);
+	m_deep_locate = getLong("CLASSAD_XROOTD_DEEP_LOCATE", 0) != 0;
+	m_manager_ttl = getLong("CLASSAD_XROOTD_MANAGER_TTL", 5*60);
+
+	m_prefetch_concurrency = getLong("CLASSAD_XROOTD_PREFETCH_CONCURRENCY", 64);
+	if (!m_prefetch_concurrency)
+		m_prefetch_concurrency = 1;
+	m_prefetch_queue = getLong("CLASSAD_XROOTD_PREFETCH_QUEUE", 100000);
+
+	m_stats_path = getString("CLASSAD_XROOTD_STATS_FILE", "");
+	m_stats_interval = getLong("CLASSAD_XROOTD_STATS_INTERVAL", 60);
+	if (!m_stats_interval)
+		m_stats_interval = 1;
+
+	m_catalog_path = getString("CLASSAD_XROOTD_CATALOG", "");
+	m_memo_entries = getLong("CLASSAD_XROOTD_MEMO_ENTRIES", 65536);
+	m_snapshot_path = getString("CLASSAD_XROOTD_SNAPSHOT", "");
+	m_snapshot_interval = getLong("CLASSAD_XROOTD_SNAPSHOT_INTERVAL", 5*60);
+	if (!m_snapshot_interval)
+		m_snapshot_interval = 1;
+}
+
+void
+Config::createInstance()
+{
+	m_instance = new Config();
+}
+
+const Config &
+Config::getInstance()
+{
+	pthread_once(&m_instance_once, createInstance);
+	return *m_instance;
+}
+
+/*
+ * Returns the default for unset, malformed, or negative values.
+ */
+long
+Config::getLong(const char *name, long default_value)
+{
+	const char *value = getenv(name);
+	if (!value || !*value)
+		return default_value;
+
+	char *end;
+	long result = strtol(value, &end, 10);
+	if (*end || result < 0)
+		return default_value;
+	return result;
+}
+
+std::string
+Config::getString(const char *name, const char *default_value)
+{
+	const char *value = getenv(name);
+	return value ? value : default_value;
+}
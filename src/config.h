@@ -0,0 +1,74 @@
+#ifndef __CONFIG_H_
+#define __CONFIG_H_
+
+#include <stddef.h>
+#include <pthread.h>
+#include <string>
+
+namespace ClassadXrootdMapping {
+
+/*
+ * Module tunables.  The module has no configuration file of its own, so,
+ * like XrdCl with its XRD_* variables, it reads them from the environment
+ * once, on first use.
+ */
+class Config {
+
+public:
+
+	static const Config &getInstance();
+
+	size_t m_cache_bytes; // CLASSAD_XROOTD_CACHE_MB; ceiling on response cache memory.
+
+	// Cache lifetimes, in seconds, for each lookup outcome.  Repeating the
+	// same outcome doubles the lifetime, up to the maximum.
+	unsigned int m_found_ttl;        // CLASSAD_XROOTD_FOUND_TTL
+	unsigned int m_found_max_ttl;    // CLASSAD_XROOTD_FOUND_MAX_TTL
+	unsigned int m_notfound_ttl;     // CLASSAD_XROOTD_NOTFOUND_TTL
+	unsigned int m_notfound_max_ttl; // CLASSAD_XROOTD_NOTFOUND_MAX_TTL
+	unsigned int m_error_ttl;        // CLASSAD_XROOTD_ERROR_TTL
+	unsigned int m_error_max_ttl;    // CLASSAD_XROOTD_ERROR_MAX_TTL
+	unsigned int m_timeout_ttl;      // CLASSAD_XROOTD_TIMEOUT_TTL
+	unsigned int m_timeout_max_ttl;  // CLASSAD_XROOTD_TIMEOUT_MAX_TTL
+
+	unsigned int m_stale_grace; // CLASSAD_XROOTD_STALE_GRACE; seconds an expired site list is still served while it is refreshed.
+
+	unsigned int m_locate_timeout; // CLASSAD_XROOTD_LOCATE_TIMEOUT; seconds before XrdCl gives up on a Locate.
+	unsigned int m_hedge_percent;  // CLASSAD_XROOTD_HEDGE_PERCENT; share of the budget before the next redirector is asked.
+	unsigned int m_breaker_failures; // CLASSAD_XROOTD_BREAKER_FAILURES; consecutive failures that open a redirector's breaker.
+	unsigned int m_breaker_open;     // CLASSAD_XROOTD_BREAKER_OPEN; seconds before a probe is let through.
+	unsigned int m_connections;    // CLASSAD_XROOTD_CONNECTIONS; connections per redirector.
+	unsigned int m_client_idle;    // CLASSAD_XROOTD_CLIENT_IDLE; seconds before an unused redirector's client is closed.
+	unsigned int m_submit_window_us; // CLASSAD_XROOTD_SUBMIT_WINDOW_US; how long requests are gathered before a batch is sent.
+	bool m_deep_locate;            // CLASSAD_XROOTD_DEEP_LOCATE; follow the managers a redirector names down to the servers.
+	unsigned int m_manager_ttl;    // CLASSAD_XROOTD_MANAGER_TTL; seconds the managers found for a directory are remembered.
+
+	unsigned int m_prefetch_concurrency; // CLASSAD_XROOTD_PREFETCH_CONCURRENCY; background lookups in flight.
+	size_t m_prefetch_queue;             // CLASSAD_XROOTD_PREFETCH_QUEUE; files waiting to be prefetched.
+
+	std::string m_stats_path;      // CLASSAD_XROOTD_STATS_FILE; unset disables the statistics dump.
+	unsigned int m_stats_interval; // CLASSAD_XROOTD_STATS_INTERVAL; seconds between dumps.
+
+	std::string m_catalog_path; // CLASSAD_XROOTD_CATALOG; unset disables the catalog.
+
+	size_t m_memo_entries; // CLASSAD_XROOTD_MEMO_ENTRIES; whole-call results remembered; 0 disables the memo.
+
+	std::string m_snapshot_path;      // CLASSAD_XROOTD_SNAPSHOT; unset disables snapshots.
+	unsigned int m_snapshot_interval; // CLASSAD_XROOTD_SNAPSHOT_INTERVAL; seconds between snapshots.
+
+private:
+
+	Config();
+
+	static long getLong(const char *name, long default_value);
+	static std::string getString(const char *name, const char *default_value);
+
+	static void createInstance();
+
+	static Config * m_instance;
+	static pthread_once_t m_instance_once;
+};
+
+}
+
+#endif
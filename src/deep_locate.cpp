@@ -0,0 +1,168 @@
+
+#include "deep_locate.h"
+#include "manager_cache.h"
+#include "xrootd_client.h"
+#include "stats.h"
+#include "time_utils.h"
+
+#include "XProtocol/XProtocol.hh"
+
+using namespace ClassadXrootdMapping;
+using namespace XrdCl;
+
+DeepLocate::DeepLocate(FileMappingResponseHandler &root, FileMappingClient &client, const std::string &path,
+	XRootDStatus *status, const HostSet &hosts, bool complete) :
+	m_root(root),
+	m_client(client),
+	m_path(path),
+	m_status(status),
+	m_hosts(hosts),
+	m_complete(complete),
+	m_direct(!hosts.empty() || !complete),
+	m_found(m_direct),
+	m_answered(false),
+	m_failure(LookupError),
+	m_shares(1)
+{
+	m_asked.insert(client.m_host);
+}
+
+void
+DeepLocate::follow(const std::vector<std::string> &managers, unsigned int depth)
+{
+	for (std::vector<std::string>::const_iterator it = managers.begin(); depth <= m_max_depth && it != managers.end(); ++it)
+	{
+		{
+			XrdSysMutexHelper lock(m_mutex);
+			// Federations may name a manager more than once, or point back up.
+			if (!m_asked.insert(*it).second)
+				continue;
+			m_shares++;
+		}
+
+		FileMappingClient *client = FileMappingClient::getClient(*it);
+		if (client && !client->admit())
+		{
+			client->Release();
+			client = NULL;
+		}
+		if (!client)
+		{
+			answer(*it, LookupError, HostSet(), true);
+			release();
+			continue;
+		}
+
+		Stats::getInstance().inc(StatDeepLocates);
+		ManagerResponseHandler *handler = new ManagerResponseHandler(*this, *client, depth);
+		XRootDStatus status = client->sendLocate(m_path, handler);
+		if (!status.IsOK())
+		{
+			Stats::getInstance().inc(StatLocateSendFailures);
+			handler->HandleResponse(new XRootDStatus(status), NULL);
+		}
+	}
+	release();
+}
+
+void
+DeepLocate::answer(const std::string &manager, LookupOutcome outcome, const HostSet &hosts, bool complete)
+{
+	// Servers whose names are still being resolved count as named.
+	bool servers = !hosts.empty() || !complete;
+	XrdSysMutexHelper lock(m_mutex);
+	m_hosts.merge(hosts);
+	m_complete = m_complete && complete;
+	if (servers)
+	{
+		m_found = true;
+		m_leaves.push_back(manager);
+	}
+	// A manager that only named other managers has not answered yet;
+	// they will.
+	if (outcome == LookupNotFound || servers)
+		m_answered = true;
+	else if (outcome != LookupFound)
+		m_failure = outcome;
+}
+
+void
+DeepLocate::release()
+{
+	unsigned int shares;
+	{
+		XrdSysMutexHelper lock(m_mutex);
+		shares = --m_shares;
+	}
+	if (shares)
+		return;
+	finish();
+	delete this;
+}
+
+void
+DeepLocate::finish()
+{
+	bool shortcut = !m_status;
+	LookupOutcome outcome;
+	XRootDStatus *status;
+	if (m_found)
+	{
+		outcome = LookupFound;
+		status = shortcut ? new XRootDStatus() : m_status;
+		m_status = NULL;
+		// Only remember the managers if they account for every server;
+		// those the redirector named itself would be lost on the shortcut.
+		if (!shortcut && !m_direct && !m_leaves.empty())
+			ManagerCache::getInstance().insert(m_client.getRedirector(), m_path, m_leaves);
+	}
+	else if (m_answered)
+	{
+		outcome = LookupNotFound;
+		status = new XRootDStatus(stError, errErrorResponse, kXR_NotFound);
+	}
+	else
+	{
+		outcome = m_failure;
+		status = new XRootDStatus(stError, (m_failure == LookupTimedOut) ? errOperationExpired : errErrorResponse);
+	}
+	delete m_status;
+	m_status = NULL;
+
+	m_root.DeepFinished(status, m_hosts, m_complete, outcome, shortcut);
+}
+
+ManagerResponseHandler::ManagerResponseHandler(DeepLocate &deep, FileMappingClient &client, unsigned int depth) :
+	m_deep(deep),
+	m_client(client),
+	m_depth(depth),
+	m_start(monotonic_us())
+{
+}
+
+void
+ManagerResponseHandler::HandleResponse(XRootDStatus *status, AnyObject *response)
+{
+	LocationInfo *info = 0;
+	if (status->IsOK() && response)
+		response->Get(info);
+	LookupOutcome outcome = FileMappingClient::classify(*status, info);
+
+	HostSet hosts;
+	bool complete = true;
+	std::vector<std::string> managers;
+	if (info)
+		complete = FileMappingClient::translate(*info, hosts, &managers);
+	delete response;
+	delete status;
+
+	m_client.recordLatency(monotonic_us() - m_start, outcome == LookupFound || outcome == LookupNotFound);
+	m_deep.answer(m_client.m_host, outcome, hosts, complete);
+
+	// Our share passes to the next level; once they are all sent, it is dropped.
+	DeepLocate &deep = m_deep;
+	unsigned int depth = m_depth;
+	m_client.Release();
+	delete this;
+	deep.follow(managers, depth + 1);
+}
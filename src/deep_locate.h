@@ -0,0 +1,92 @@
+#ifndef __DEEPLOCATE_H_
+#define __DEEPLOCATE_H_
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "XrdCl/XrdClXRootDResponses.hh"
+#include "XrdSys/XrdSysPthread.hh"
+
+#include "host_table.h"
+#include "response_cache.h"
+
+namespace ClassadXrootdMapping {
+
+class FileMappingClient;
+class FileMappingResponseHandler;
+
+/*
+ * One deep locate, for CLASSAD_XROOTD_DEEP_LOCATE: follows the managers a
+ * redirector named for a file down to the data servers, asking every
+ * manager of a level at once.  Each manager is asked through its own
+ * client, so it has its own connections, latency and circuit breaker.
+ *
+ * Every request in flight holds a share of the DeepLocate, as does the
+ * caller of follow() until it returns.  Whoever drops the last share hands
+ * the servers found to the lookup the DeepLocate was started for, and
+ * deletes it.
+ */
+class DeepLocate {
+
+public:
+
+	// `status` is the redirector's answer, with the servers it named; the
+	// DeepLocate owns it from here on.  Without one, the managers came from
+	// the ManagerCache, and the redirector is asked after all if they fail.
+	DeepLocate(FileMappingResponseHandler &root, FileMappingClient &client, const std::string &path,
+		XrdCl::XRootDStatus *status, const HostSet &hosts, bool complete);
+
+	// Asks each of the managers not asked yet, then drops the caller's share.
+	void follow(const std::vector<std::string> &managers, unsigned int depth);
+
+	// One manager's answer: the servers it named, if any.
+	void answer(const std::string &manager, LookupOutcome outcome, const HostSet &hosts, bool complete);
+
+private:
+
+	void release();
+	void finish();
+
+	static const unsigned int m_max_depth = 4; // Levels of managers below the redirector.
+
+	FileMappingResponseHandler &m_root;
+	FileMappingClient &m_client; // The redirector, referenced by m_root.
+	std::string m_path;
+	XrdCl::XRootDStatus *m_status;
+
+	HostSet m_hosts;
+	bool m_complete;             // False if some hostnames were not resolved yet.
+	bool m_direct;               // The redirector named some servers itself.
+	bool m_found;                // Some servers were named, if not all resolved yet.
+	bool m_answered;             // Some manager gave a definite answer.
+	LookupOutcome m_failure;     // How the last manager that gave none failed.
+	std::set<std::string> m_asked;
+	std::vector<std::string> m_leaves; // Managers that named servers.
+	unsigned int m_shares;
+	XrdSysMutex m_mutex; // Protects the members above.
+};
+
+/*
+ * Handler for one request to a manager; deletes itself once it is done.
+ */
+class ManagerResponseHandler : public XrdCl::ResponseHandler {
+
+public:
+
+	// Takes over the caller's reference to the client.
+	ManagerResponseHandler(DeepLocate &deep, FileMappingClient &client, unsigned int depth);
+
+	virtual void HandleResponse(XrdCl::XRootDStatus *status, XrdCl::AnyObject *response);
+
+private:
+
+	DeepLocate &m_deep;
+	FileMappingClient &m_client;
+	unsigned int m_depth;
+	uint64_t m_start; // Microseconds.
+};
+
+}
+
+#endif
@@ -0,0 +1,185 @@
+
+#include <cstdio>
+#include <sstream>
+
+#include "fake_redirector.h"
+#include "time_utils.h"
+
+using namespace ClassadXrootdMapping;
+using namespace XrdCl;
+
+const unsigned int FakeRedirector::m_reply_threads = 4;
+
+FakeRedirector::FakeRedirector(unsigned int latency_us, unsigned int jitter_us, double loss,
+		unsigned int sites, unsigned int replicas, unsigned int managers) :
+	m_latency_us(latency_us),
+	m_jitter_us(jitter_us),
+	m_loss(loss),
+	m_sites(sites ? sites : 1),
+	m_replicas(replicas),
+	m_managers(managers),
+	m_seed(0x9e3779b97f4a7c15ULL),
+	m_cond(0)
+{
+	if (m_replicas > m_sites)
+		m_replicas = m_sites;
+	for (unsigned int idx = 0; idx < m_reply_threads; idx++)
+	{
+		pthread_t tid;
+		XrdSysThread::Run(&tid, replyThread, this, 0, "Fake redirector");
+	}
+}
+
+XRootDStatus
+FakeRedirector::locate(FileSystem &, const std::string &host, const std::string &path, ResponseHandler *handler, uint16_t timeout)
+{
+	FakeReply item;
+	item.m_handler = handler;
+	item.m_host = host;
+	item.m_path = path;
+
+	XrdSysCondVarHelper monitor(m_cond);
+	// xorshift64; good enough for jitter and loss.
+	m_seed ^= m_seed << 13;
+	m_seed ^= m_seed >> 7;
+	m_seed ^= m_seed << 17;
+	item.m_lost = (m_seed % 1000000) < m_loss*1000000;
+	item.m_down = m_down.count(host) > 0;
+	std::map<std::string, unsigned int>::const_iterator latency = m_host_latency_us.find(host);
+	if (item.m_down)
+		item.m_due_us = monotonic_us();
+	else if (item.m_lost)
+		item.m_due_us = monotonic_us() + static_cast<uint64_t>(timeout ? timeout : 60)*1000000;
+	else if (latency != m_host_latency_us.end())
+		item.m_due_us = monotonic_us() + latency->second;
+	else
+		item.m_due_us = monotonic_us() + m_latency_us + (m_jitter_us ? (m_seed >> 20) % m_jitter_us : 0);
+	m_queue.push(item);
+	m_cond.Signal();
+	return XRootDStatus();
+}
+
+void
+FakeRedirector::setLatency(const std::string &host, unsigned int latency_us)
+{
+	XrdSysCondVarHelper monitor(m_cond);
+	m_host_latency_us[host] = latency_us;
+}
+
+void
+FakeRedirector::setDown(const std::string &host, bool down)
+{
+	XrdSysCondVarHelper monitor(m_cond);
+	if (down)
+		m_down.insert(host);
+	else
+		m_down.erase(host);
+}
+
+void *
+FakeRedirector::replyThread(void *arg)
+{
+	static_cast<FakeRedirector *>(arg)->replyLoop();
+	return NULL;
+}
+
+void
+FakeRedirector::replyLoop()
+{
+	m_cond.Lock();
+	while (true)
+	{
+		if (m_queue.empty())
+		{
+			m_cond.Wait();
+			continue;
+		}
+		uint64_t now = monotonic_us();
+		if (m_queue.top().m_due_us > now)
+		{
+			m_cond.WaitMS((m_queue.top().m_due_us - now + 999) / 1000);
+			continue;
+		}
+		FakeReply item = m_queue.top();
+		m_queue.pop();
+		m_cond.UnLock();
+		reply(item);
+		m_cond.Lock();
+	}
+}
+
+void
+FakeRedirector::reply(const FakeReply &item)
+{
+	if (item.m_down)
+	{
+		item.m_handler->HandleResponse(new XRootDStatus(stError, errConnectionError), NULL);
+		return;
+	}
+	if (item.m_lost)
+	{
+		item.m_handler->HandleResponse(new XRootDStatus(stError, errOperationExpired), NULL);
+		return;
+	}
+
+	// FNV-1a, so each file always lives at the same sites.
+	uint64_t hash = 14695981039346656037ULL;
+	for (std::string::const_iterator it = item.m_path.begin(); it != item.m_path.end(); ++it)
+	{
+		hash = (hash ^ static_cast<unsigned char>(*it)) * 1099511628211ULL;
+	}
+
+	unsigned int high, low;
+	bool at_manager = m_managers && sscanf(item.m_host.c_str(), "[::127.1.%u.%u]", &high, &low) == 2;
+	unsigned int manager = at_manager ? (high << 8 | low) : 0;
+
+	LocationInfo *info = new LocationInfo();
+	std::vector<bool> named(m_managers, false);
+	for (unsigned int idx = 0; idx < m_replicas; idx++)
+	{
+		unsigned int site = (hash + idx) % m_sites;
+		if (m_managers && !at_manager)
+		{
+			if (!named[site % m_managers])
+				info->Add(LocationInfo::Location(getManagerAddress(site % m_managers),
+					LocationInfo::ManagerOnline, LocationInfo::Read));
+			named[site % m_managers] = true;
+		}
+		else if (!at_manager || site % m_managers == manager)
+		{
+			info->Add(LocationInfo::Location(getAddress(site),
+				LocationInfo::ServerOnline, LocationInfo::Read));
+		}
+	}
+	AnyObject *response = new AnyObject();
+	response->Set(info);
+	item.m_handler->HandleResponse(new XRootDStatus(), response);
+}
+
+std::string
+FakeRedirector::getAddress(unsigned int site)
+{
+	std::stringstream address;
+	address << "[::127.0." << ((site >> 8) & 0xff) << "." << (site & 0xff) << "]:1094";
+	return address.str();
+}
+
+std::string
+FakeRedirector::getManagerAddress(unsigned int manager)
+{
+	std::stringstream address;
+	address << "[::127.1." << ((manager >> 8) & 0xff) << "." << (manager & 0xff) << "]:1094";
+	return address.str();
+}
+
+bool
+FakeResolver::resolve(const std::string &address, std::string &hostname)
+{
+	unsigned int high, low;
+	if (sscanf(address.c_str(), "127.0.%u.%u", &high, &low) != 2)
+		return false;
+	std::stringstream name;
+	name << "site" << (high << 8 | low) << ".bench";
+	hostname = name.str();
+	return true;
+}
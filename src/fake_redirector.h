@@ -0,0 +1,105 @@
+#ifndef __FAKEREDIRECTOR_H_
+#define __FAKEREDIRECTOR_H_
+
+#include <map>
+#include <queue>
+#include <set>
+#include <string>
+#include <vector>
+#include "XrdSys/XrdSysPthread.hh"
+
+#include "locate_backend.h"
+#include "hostname_cache.h"
+
+namespace ClassadXrootdMapping {
+
+/*
+ * A pending answer of the fake redirector, due at m_due_us.
+ */
+struct FakeReply {
+	uint64_t m_due_us;
+	XrdCl::ResponseHandler *m_handler;
+	std::string m_host; // The redirector or manager asked.
+	std::string m_path;
+	bool m_lost;
+	bool m_down; // Fails at once, as if the connection were refused.
+};
+
+struct FakeReplyLater {
+	bool operator()(const FakeReply &left, const FakeReply &right) const
+	{
+		return left.m_due_us > right.m_due_us;
+	}
+};
+
+typedef std::priority_queue<FakeReply, std::vector<FakeReply>, FakeReplyLater> FakeReplyQueue;
+
+/*
+ * In-process stand-in for a redirector, for benchmarking without a network.
+ *
+ * Every file is found at `replicas` of `sites` servers, chosen by hashing
+ * its name, so repeated lookups agree.  Answers arrive after `latency_us`
+ * plus up to `jitter_us`; a `loss` fraction of the requests is never
+ * answered and times out as XrdCl would.
+ *
+ * With `managers`, the sites are split among that many managers, and the
+ * redirector names the managers of a file's sites instead of the servers;
+ * each manager names its own sites only.  This is the federation a deep
+ * locate walks.
+ *
+ * Tests can slow down or take down single redirectors and managers by name.
+ */
+class FakeRedirector : public LocateBackend {
+
+public:
+
+	FakeRedirector(unsigned int latency_us, unsigned int jitter_us, double loss,
+		unsigned int sites, unsigned int replicas, unsigned int managers = 0);
+
+	virtual XrdCl::XRootDStatus locate(XrdCl::FileSystem &fs, const std::string &host,
+		const std::string &path, XrdCl::ResponseHandler *handler, uint16_t timeout);
+
+	// Answers from `host` take `latency_us`, without jitter, instead.
+	void setLatency(const std::string &host, unsigned int latency_us);
+	// Requests to `host` fail at once while it is down.
+	void setDown(const std::string &host, bool down);
+
+	// The server address for a site; FakeResolver maps it back.
+	static std::string getAddress(unsigned int site);
+	static std::string getManagerAddress(unsigned int manager);
+
+private:
+
+	void replyLoop();
+	static void *replyThread(void *);
+	void reply(const FakeReply &);
+
+	static const unsigned int m_reply_threads;
+
+	unsigned int m_latency_us;
+	unsigned int m_jitter_us;
+	double m_loss;
+	unsigned int m_sites;
+	unsigned int m_replicas;
+	unsigned int m_managers;
+
+	std::map<std::string, unsigned int> m_host_latency_us;
+	std::set<std::string> m_down;
+	uint64_t m_seed; // State of the generator for jitter and loss.
+	FakeReplyQueue m_queue;
+	XrdSysCondVar m_cond; // Protects everything above.
+};
+
+/*
+ * Names the servers of FakeRedirector "site<N>.bench", without DNS.
+ */
+class FakeResolver : public HostnameResolver {
+
+public:
+
+	virtual bool resolve(const std::string &address, std::string &hostname);
+};
+
+}
+
+#endif
@@ -0,0 +1,205 @@
+
+#include <algorithm>
+
+#include "host_table.h"
+
+using namespace ClassadXrootdMapping;
+
+HostTable * HostTable::m_instance = NULL;
+pthread_once_t HostTable::m_instance_once = PTHREAD_ONCE_INIT;
+HostTable * HostTable::m_redirector_table = NULL;
+pthread_once_t HostTable::m_redirector_once = PTHREAD_ONCE_INIT;
+
+HostTable::HostTable() :
+	m_index(new HostIndex(64)),
+	m_next_id(0)
+{
+	for (unsigned int idx = 0; idx < m_max_chunks; idx++)
+	{
+		m_chunks[idx] = NULL;
+	}
+}
+
+void
+HostTable::createInstance()
+{
+	m_instance = new HostTable();
+}
+
+HostTable &
+HostTable::getInstance()
+{
+	pthread_once(&m_instance_once, createInstance);
+	return *m_instance;
+}
+
+void
+HostTable::createRedirectorTable()
+{
+	m_redirector_table = new HostTable();
+}
+
+HostTable &
+HostTable::getRedirectorTable()
+{
+	pthread_once(&m_redirector_once, createRedirectorTable);
+	return *m_redirector_table;
+}
+
+uint32_t
+HostTable::hashName(const std::string &hostname)
+{
+	// FNV-1a.
+	uint32_t hash = 2166136261U;
+	for (std::string::const_iterator it = hostname.begin(); it != hostname.end(); ++it)
+	{
+		hash ^= static_cast<unsigned char>(*it);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+bool
+HostTable::find(const std::string &hostname, HostId &id)
+{
+	const HostIndex *index = m_index;
+	for (size_t slot = hashName(hostname) & index->m_mask; ; slot = (slot + 1) & index->m_mask)
+	{
+		HostId entry = index->m_slots[slot];
+		if (!entry)
+			return false;
+		if (getName(entry - 1) == hostname)
+		{
+			id = entry - 1;
+			return true;
+		}
+	}
+}
+
+void
+HostTable::addToIndex(HostIndex &index, HostId id)
+{
+	size_t slot = hashName(getName(id)) & index.m_mask;
+	while (index.m_slots[slot])
+	{
+		slot = (slot + 1) & index.m_mask;
+	}
+	index.m_slots[slot] = id + 1;
+}
+
+bool
+HostTable::intern(const std::string &hostname, HostId &id)
+{
+	if (find(hostname, id))
+		return true;
+
+	XrdSysMutexHelper lock(m_mutex);
+
+	if (find(hostname, id))
+		return true;
+	if (m_next_id == m_chunk_size*m_max_chunks)
+		return false;
+
+	id = m_next_id;
+	std::string *chunk = m_chunks[id / m_chunk_size];
+	if (!chunk)
+	{
+		chunk = new std::string[m_chunk_size];
+		m_chunks[id / m_chunk_size] = chunk;
+	}
+	chunk[id % m_chunk_size] = hostname;
+
+	HostIndex *index = m_index;
+	if (2*(id + 1) > index->m_slots.size())
+	{
+		HostIndex *grown = new HostIndex(2*index->m_slots.size());
+		for (HostId old_id = 0; old_id <= id; old_id++)
+		{
+			addToIndex(*grown, old_id);
+		}
+		// The index must be complete before it is published.
+#ifdef HAVE_ATOMICS
+		__sync_synchronize();
+#endif
+		m_index = grown;
+		m_retired_indexes.push_back(index);
+	}
+	else
+	{
+		// The name must be visible before anyone can learn its ID.
+#ifdef HAVE_ATOMICS
+		__sync_synchronize();
+#endif
+		addToIndex(*index, id);
+	}
+	m_next_id++;
+	return true;
+}
+
+const std::string &
+HostTable::getName(HostId id) const
+{
+	return m_chunks[id / m_chunk_size][id % m_chunk_size];
+}
+
+void
+HostSet::insert(HostId id)
+{
+	size_t word = id / 64;
+	if (word >= m_words.size())
+		m_words.resize(word + 1, 0);
+	m_words[word] |= static_cast<uint64_t>(1) << (id % 64);
+}
+
+bool
+HostSet::contains(HostId id) const
+{
+	size_t word = id / 64;
+	if (word >= m_words.size())
+		return false;
+	return (m_words[word] >> (id % 64)) & 1;
+}
+
+void
+HostSet::merge(const HostSet &other)
+{
+	if (other.m_words.size() > m_words.size())
+		m_words.resize(other.m_words.size(), 0);
+
+	// Plain loop over words; the compiler vectorizes it.
+	const uint64_t *src = other.m_words.empty() ? NULL : &other.m_words[0];
+	uint64_t *dst = m_words.empty() ? NULL : &m_words[0];
+	size_t count = other.m_words.size();
+	for (size_t idx = 0; idx < count; idx++)
+	{
+		dst[idx] |= src[idx];
+	}
+}
+
+void
+HostSet::getIds(std::vector<HostId> &ids) const
+{
+	for (size_t word = 0; word < m_words.size(); word++)
+	{
+		uint64_t bits = m_words[word];
+		while (bits)
+		{
+			unsigned int bit = __builtin_ctzll(bits);
+			bits &= bits - 1;
+			ids.push_back(word*64 + bit);
+		}
+	}
+}
+
+void
+HostSet::getNames(std::vector<std::string> &names) const
+{
+	HostTable &table = HostTable::getInstance();
+	std::vector<HostId> ids;
+	getIds(ids);
+	for (std::vector<HostId>::const_iterator it = ids.begin(); it != ids.end(); ++it)
+	{
+		names.push_back(table.getName(*it));
+	}
+	std::sort(names.begin(), names.end());
+}
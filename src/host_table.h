@@ -0,0 +1,122 @@
+#ifndef __HOSTTABLE_H_
+#define __HOSTTABLE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "XrdSys/XrdSysPthread.hh"
+
+#include "classad/classad_distribution.h"
+
+namespace ClassadXrootdMapping {
+
+typedef uint32_t HostId;
+typedef uint32_t RedirectorId;
+
+/*
+ * Open-addressing index from names to IDs.  A slot holds its ID plus one,
+ * or 0 while empty, and is written only once, after the name it points
+ * to.  At most half the slots are used, so every probe ends.
+ */
+struct HostIndex {
+	HostIndex(size_t size) : m_mask(size - 1), m_slots(size, 0) {}
+
+	size_t m_mask; // The size, a power of two, minus one.
+	std::vector<HostId> m_slots;
+};
+
+/*
+ * Process-wide table interning hostnames into small, dense IDs.
+ *
+ * The whole federation has a few hundred storage hosts, so cache entries
+ * store IDs instead of copies of the names.  IDs are never reused.  Names
+ * live in fixed-size chunks that never move, so getName() takes no lock,
+ * and neither does find(): slots are only ever filled in, and a full
+ * index is replaced by a bigger copy.
+ */
+class HostTable {
+
+public:
+
+	// Returns false only if the table is full.
+	bool intern(const std::string &hostname, HostId &id);
+
+	// Like intern(), but never adds the name.
+	bool find(const std::string &hostname, HostId &id);
+
+	const std::string &getName(HostId id) const;
+
+	static HostTable &getInstance();
+
+	// Redirectors are interned in a table of their own, so their IDs do not
+	// widen every HostSet.
+	static HostTable &getRedirectorTable();
+
+private:
+
+	HostTable();
+
+	static void createInstance();
+	static void createRedirectorTable();
+
+	static const unsigned int m_chunk_size = 1024;
+	static const unsigned int m_max_chunks = 1024;
+
+	static uint32_t hashName(const std::string &hostname);
+
+	// Must be called with m_mutex held.
+	void addToIndex(HostIndex &index, HostId id);
+
+	HostIndex * volatile m_index;
+	// Replaced indexes are retired rather than freed, as readers may still
+	// hold them; each is half the size of the next, so together they take
+	// no more room than the current one.
+	std::vector<HostIndex *> m_retired_indexes;
+	std::string * volatile m_chunks[m_max_chunks];
+	HostId m_next_id;
+	XrdSysMutex m_mutex; // Serializes writers.
+
+	static HostTable * m_instance;
+	static pthread_once_t m_instance_once;
+	static HostTable * m_redirector_table;
+	static pthread_once_t m_redirector_once;
+};
+
+/*
+ * A set of interned hosts, stored as a bitset over their IDs.  Merging the
+ * answers for many files is then a word-wise OR.
+ */
+class HostSet {
+
+public:
+
+	void insert(HostId id);
+
+	bool contains(HostId id) const;
+
+	void merge(const HostSet &other);
+
+	bool empty() const { return m_words.empty(); }
+
+	void clear() { m_words.clear(); }
+
+	void swap(HostSet &other) { m_words.swap(other.m_words); }
+
+	void getIds(std::vector<HostId> &ids) const;
+
+	// Sorted by name, so the lists handed to ClassAds are stable.
+	void getNames(std::vector<std::string> &names) const;
+
+	bool operator==(const HostSet &other) const { return m_words == other.m_words; }
+
+	const std::vector<uint64_t> &getWords() const { return m_words; }
+
+private:
+
+	// Never has trailing zero words, so equal sets compare equal.
+	std::vector<uint64_t> m_words;
+};
+
+}
+
+#endif
@@ -0,0 +1,162 @@
+
+#include <algorithm>
+#include <vector>
+#include <netinet/in.h>
+
+#include "XrdSys/XrdSysDNS.hh"
+#include "hostname_cache.h"
+#include "stats.h"
+#include "time_utils.h"
+
+using namespace ClassadXrootdMapping;
+
+HostnameCache * HostnameCache::m_instance = NULL;
+pthread_once_t HostnameCache::m_instance_once = PTHREAD_ONCE_INIT;
+DNSResolver HostnameCache::m_dns_resolver;
+
+const unsigned int HostnameCache::m_positive_lifetime_seconds = 60*60;
+const unsigned int HostnameCache::m_negative_lifetime_seconds = 5*60;
+const unsigned int HostnameCache::m_resolver_threads = 4;
+
+bool
+DNSResolver::resolve(const std::string &address, std::string &hostname)
+{
+	// This union trick is to make sure we get enough memory for the sockaddr and that
+	// things are exception-safe.
+	std::vector<char> sock_mem;
+	sock_mem.resize(std::max(sizeof(struct sockaddr_in), sizeof(struct sockaddr_in6)));
+	typedef union {struct sockaddr* addr; char * memory;} sockaddr_big;
+	sockaddr_big addr;
+	addr.memory = &sock_mem[0];
+	if (!XrdSysDNS::Host2Dest(address.c_str(), *(addr.addr), 0))
+	{
+		return false;
+	}
+
+	char * hostname_result = XrdSysDNS::getHostName(*(addr.addr), NULL);
+	if (!hostname_result)
+	{
+		return false;
+	}
+	hostname = hostname_result;
+	free(hostname_result);
+	return true;
+}
+
+HostnameCache::HostnameCache() :
+	m_cond(0),
+	m_resolver(&m_dns_resolver)
+{
+	for (unsigned int idx = 0; idx < m_resolver_threads; idx++)
+	{
+		pthread_t tid;
+		XrdSysThread::Run(&tid, resolverThread, this, 0, "Hostname resolver");
+	}
+}
+
+void
+HostnameCache::createInstance()
+{
+	m_instance = new HostnameCache();
+}
+
+HostnameCache &
+HostnameCache::getInstance()
+{
+	pthread_once(&m_instance_once, createInstance);
+	return *m_instance;
+}
+
+void
+HostnameCache::setResolver(HostnameResolver &resolver)
+{
+	XrdSysCondVarHelper monitor(m_cond);
+	m_resolver = &resolver;
+}
+
+HostnameCache::Result
+HostnameCache::lookup(const std::string &address, std::string &hostname)
+{
+	time_t now = time(NULL);
+
+	XrdSysCondVarHelper monitor(m_cond);
+
+	HostnameEntry &entry = m_map[address];
+	if (entry.m_expiration <= now)
+	{
+		// Refresh in the background; meanwhile, keep serving the old answer.
+		enqueue(address, entry);
+	}
+	if (entry.m_resolved)
+	{
+		hostname = entry.m_hostname;
+		return Resolved;
+	}
+	return entry.m_expiration ? Unresolvable : Pending;
+}
+
+/*
+ * Must be called with m_cond locked.
+ */
+void
+HostnameCache::enqueue(const std::string &address, HostnameEntry &entry)
+{
+	if (entry.m_pending)
+		return;
+	entry.m_pending = true;
+	m_queue.push_back(address);
+	m_cond.Signal();
+}
+
+void *
+HostnameCache::resolverThread(void *arg)
+{
+	static_cast<HostnameCache*>(arg)->resolveLoop();
+	return NULL;
+}
+
+void
+HostnameCache::resolveLoop()
+{
+	while (true)
+	{
+		std::string address;
+		HostnameResolver *resolver;
+		{
+			XrdSysCondVarHelper monitor(m_cond);
+			while (m_queue.empty())
+				m_cond.Wait();
+			address = m_queue.front();
+			m_queue.pop_front();
+			resolver = m_resolver;
+		}
+
+		// The DNS query happens without any lock held.
+		std::string hostname;
+		uint64_t start_us = monotonic_us();
+		bool resolved = resolver->resolve(address, hostname);
+
+		Stats &stats = Stats::getInstance();
+		stats.record(StatDnsLatency, monotonic_us() - start_us);
+		stats.inc(StatDnsLookups);
+		if (!resolved)
+			stats.inc(StatDnsFailures);
+
+		time_t now = time(NULL);
+		XrdSysCondVarHelper monitor(m_cond);
+		HostnameEntry &entry = m_map[address];
+		entry.m_pending = false;
+		if (resolved)
+		{
+			entry.m_hostname = hostname;
+			entry.m_resolved = true;
+			entry.m_expiration = now + m_positive_lifetime_seconds;
+		}
+		else
+		{
+			// Keep any older answer, but do not retry before the negative lifetime.
+			entry.m_expiration = now + m_negative_lifetime_seconds;
+		}
+	}
+	return;
+}
@@ -0,0 +1,96 @@
+#ifndef __HOSTNAMECACHE_H_
+#define __HOSTNAMECACHE_H_
+
+#include <deque>
+#include <string>
+#include "XrdSys/XrdSysPthread.hh"
+
+#include "classad/classad_distribution.h"
+
+namespace ClassadXrootdMapping {
+
+/*
+ * Translates a server address from a Locate response into a hostname.
+ * The default implementation does a reverse DNS lookup; tests can install
+ * a local stub with HostnameCache::setResolver.
+ */
+class HostnameResolver {
+
+public:
+
+	virtual ~HostnameResolver() {}
+
+	// Blocking; returns false if the address has no usable hostname.
+	virtual bool resolve(const std::string &address, std::string &hostname) = 0;
+};
+
+class DNSResolver : public HostnameResolver {
+
+public:
+
+	virtual bool resolve(const std::string &address, std::string &hostname);
+};
+
+struct HostnameEntry {
+	HostnameEntry() : m_expiration(0), m_resolved(false), m_pending(false) {}
+
+	std::string m_hostname;
+	time_t m_expiration; // 0 until the first answer arrives.
+	bool m_resolved; // False for a negative entry.
+	bool m_pending;  // Queued for the resolver threads.
+};
+
+typedef classad_unordered<std::string, HostnameEntry> HostnameMap;
+
+/*
+ * Process-wide cache of address -> hostname translations.
+ *
+ * Lookups never block on DNS: a miss is queued for a small pool of
+ * resolver threads and reported as Pending.  Expired positive entries keep
+ * being served while they are refreshed.
+ */
+class HostnameCache {
+
+public:
+
+	enum Result {
+		Resolved,
+		Unresolvable,
+		Pending
+	};
+
+	Result lookup(const std::string &address, std::string &hostname);
+
+	// The resolver is not owned by the cache and must outlive it.
+	void setResolver(HostnameResolver &resolver);
+
+	static HostnameCache &getInstance();
+
+private:
+
+	HostnameCache();
+
+	static void createInstance();
+
+	void enqueue(const std::string &address, HostnameEntry &entry);
+	void resolveLoop();
+	static void *resolverThread(void *);
+
+	static const unsigned int m_positive_lifetime_seconds;
+	static const unsigned int m_negative_lifetime_seconds;
+	static const unsigned int m_resolver_threads;
+
+	HostnameMap m_map;
+	std::deque<std::string> m_queue;
+	XrdSysCondVar m_cond; // Protects everything above.
+
+	HostnameResolver *m_resolver;
+
+	static HostnameCache * m_instance;
+	static pthread_once_t m_instance_once;
+	static DNSResolver m_dns_resolver;
+};
+
+}
+
+#endif
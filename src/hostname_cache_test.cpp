@@ -0,0 +1,99 @@
+
+#include <cstdio>
+#include <map>
+#include <string>
+
+#include "hostname_cache.h"
+#include "test_utils.h"
+#include "time_utils.h"
+
+using namespace ClassadXrootdMapping;
+
+/*
+ * Names 10.0.0.<N> "host<N>.example.org" and fails every other address,
+ * counting the queries for each.
+ */
+class StubResolver : public HostnameResolver {
+
+public:
+
+	virtual bool resolve(const std::string &address, std::string &hostname)
+	{
+		{
+			XrdSysMutexHelper lock(m_mutex);
+			m_queries[address]++;
+		}
+		unsigned int host;
+		if (sscanf(address.c_str(), "10.0.0.%u", &host) != 1)
+			return false;
+		char name[64];
+		snprintf(name, sizeof(name), "host%u.example.org", host);
+		hostname = name;
+		return true;
+	}
+
+	unsigned int queries(const std::string &address)
+	{
+		XrdSysMutexHelper lock(m_mutex);
+		return m_queries[address];
+	}
+
+private:
+
+	std::map<std::string, unsigned int> m_queries;
+	XrdSysMutex m_mutex;
+};
+
+// Looks the address up until it is no longer pending, for at most five seconds.
+static HostnameCache::Result settle(const std::string &address, std::string &hostname)
+{
+	HostnameCache &cache = HostnameCache::getInstance();
+	uint64_t deadline = monotonic_ms() + 5000;
+	HostnameCache::Result result;
+	while ((result = cache.lookup(address, hostname)) == HostnameCache::Pending && remaining_ms(deadline))
+	{
+		sleep_us(1000);
+	}
+	return result;
+}
+
+int main() {
+
+	StubResolver resolver;
+	HostnameCache &cache = HostnameCache::getInstance();
+	cache.setResolver(resolver);
+	std::string hostname;
+
+	// A miss is reported at once and resolved in the background; lookups
+	// meanwhile share the one query.
+	check(cache.lookup("10.0.0.1", hostname) == HostnameCache::Pending, "first lookup is pending");
+	for (unsigned int idx = 0; idx < 100; idx++)
+	{
+		cache.lookup("10.0.0.1", hostname);
+	}
+	check(settle("10.0.0.1", hostname) == HostnameCache::Resolved, "pending address resolved");
+	checkEqual(hostname, std::string("host1.example.org"), "resolved name");
+	checkEqual(resolver.queries("10.0.0.1"), 1u, "queries for a pending address");
+
+	// Positive answers are served from the cache.
+	hostname.clear();
+	check(cache.lookup("10.0.0.1", hostname) == HostnameCache::Resolved, "resolved address cached");
+	checkEqual(hostname, std::string("host1.example.org"), "cached name");
+	checkEqual(resolver.queries("10.0.0.1"), 1u, "queries for a cached address");
+
+	// A failed query is cached too, and not retried within the negative lifetime.
+	check(cache.lookup("192.0.2.1", hostname) == HostnameCache::Pending, "unknown address is pending");
+	check(settle("192.0.2.1", hostname) == HostnameCache::Unresolvable, "unknown address unresolvable");
+	for (unsigned int idx = 0; idx < 10; idx++)
+	{
+		check(cache.lookup("192.0.2.1", hostname) == HostnameCache::Unresolvable, "negative answer cached");
+	}
+	sleep_us(100000);
+	checkEqual(resolver.queries("192.0.2.1"), 1u, "queries for an unresolvable address");
+
+	// Addresses are cached independently.
+	check(settle("10.0.0.2", hostname) == HostnameCache::Resolved, "second address resolved");
+	checkEqual(hostname, std::string("host2.example.org"), "second name");
+
+	return finishTests("hostname cache");
+}
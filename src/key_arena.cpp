@@ -0,0 +1,177 @@
+
+#include <cstring>
+
+#include "key_arena.h"
+
+using namespace ClassadXrootdMapping;
+
+const PrefixHandle PrefixArena::m_empty;
+
+uint32_t
+ClassadXrootdMapping::hashKey(const char *data, size_t length)
+{
+	// FxHash over whole words, finished with MurmurHash3's mixer.
+	uint64_t hash = length;
+	while (length >= sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, data, sizeof(word));
+		hash = ((hash << 5 | hash >> 59) ^ word) * 0x517cc1b727220a95ULL;
+		data += sizeof(word);
+		length -= sizeof(word);
+	}
+	if (length)
+	{
+		uint64_t word = 0;
+		memcpy(&word, data, length);
+		hash = ((hash << 5 | hash >> 59) ^ word) * 0x517cc1b727220a95ULL;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return static_cast<uint32_t>(hash);
+}
+
+PrefixArena::PrefixArena() :
+	m_live(0),
+	m_dead_chars(0)
+{
+}
+
+size_t
+PrefixArena::split(const char *key, size_t length)
+{
+	for (size_t idx = length; idx > 0; idx--)
+	{
+		if (key[idx - 1] == '/')
+			return idx;
+	}
+	// No directory; share the redirector part at least.
+	const char *colon = static_cast<const char *>(memchr(key, ':', length));
+	return colon ? colon - key + 1 : 0;
+}
+
+PrefixHandle
+PrefixArena::acquire(const char *data, size_t length)
+{
+	// Keep the index at most three quarters full.
+	if ((m_live + 1) * 4 > m_index.size() * 3)
+		grow();
+
+	uint32_t hash = hashKey(data, length);
+	size_t mask = m_index.size() - 1;
+	size_t slot = hash & mask;
+	for (; m_index[slot] != m_empty; slot = (slot + 1) & mask)
+	{
+		PrefixRecord &record = m_records[m_index[slot]];
+		if (record.m_hash == hash && record.m_length == length &&
+			!memcmp(m_chars.data() + record.m_offset, data, length))
+		{
+			record.m_refs++;
+			return m_index[slot];
+		}
+	}
+
+	PrefixHandle handle;
+	if (m_free.empty())
+	{
+		handle = m_records.size();
+		m_records.push_back(PrefixRecord());
+	}
+	else
+	{
+		handle = m_free.back();
+		m_free.pop_back();
+	}
+	PrefixRecord &record = m_records[handle];
+	record.m_offset = m_chars.size();
+	record.m_length = length;
+	record.m_hash = hash;
+	record.m_refs = 1;
+	m_chars.append(data, length);
+
+	m_index[slot] = handle;
+	m_live++;
+	return handle;
+}
+
+void
+PrefixArena::release(PrefixHandle handle)
+{
+	PrefixRecord &record = m_records[handle];
+	if (--record.m_refs)
+		return;
+
+	// Linear probing; shift the rest of the cluster back over the hole
+	// rather than leave a tombstone.
+	size_t mask = m_index.size() - 1;
+	size_t hole = record.m_hash & mask;
+	while (m_index[hole] != handle)
+	{
+		hole = (hole + 1) & mask;
+	}
+	for (size_t slot = (hole + 1) & mask; m_index[slot] != m_empty; slot = (slot + 1) & mask)
+	{
+		size_t home = m_records[m_index[slot]].m_hash & mask;
+		// Move it unless its home lies cyclically in (hole, slot].
+		bool movable = (hole <= slot) ? (home <= hole || home > slot) : (home <= hole && home > slot);
+		if (movable)
+		{
+			m_index[hole] = m_index[slot];
+			hole = slot;
+		}
+	}
+	m_index[hole] = m_empty;
+
+	m_free.push_back(handle);
+	m_live--;
+	m_dead_chars += record.m_length;
+	if (m_dead_chars > 64*1024 && m_dead_chars * 2 > m_chars.size())
+		compact();
+}
+
+void
+PrefixArena::grow()
+{
+	std::vector<PrefixHandle> index(m_index.empty() ? 64 : m_index.size() * 2, m_empty);
+	size_t mask = index.size() - 1;
+	for (PrefixHandle handle = 0; handle < m_records.size(); handle++)
+	{
+		if (!m_records[handle].m_refs)
+			continue;
+		size_t slot = m_records[handle].m_hash & mask;
+		while (index[slot] != m_empty)
+		{
+			slot = (slot + 1) & mask;
+		}
+		index[slot] = handle;
+	}
+	m_index.swap(index);
+}
+
+void
+PrefixArena::compact()
+{
+	std::string chars;
+	chars.reserve(m_chars.size() - m_dead_chars);
+	for (std::vector<PrefixRecord>::iterator it = m_records.begin(); it != m_records.end(); ++it)
+	{
+		if (!it->m_refs)
+			continue;
+		uint32_t offset = chars.size();
+		chars.append(m_chars, it->m_offset, it->m_length);
+		it->m_offset = offset;
+	}
+	m_chars.swap(chars);
+	m_dead_chars = 0;
+}
+
+size_t
+PrefixArena::bytes() const
+{
+	// Only what the live prefixes hold, so that evicting entries is seen
+	// to free their prefixes even before the buffer is compacted.
+	return m_chars.size() - m_dead_chars + m_live*(sizeof(PrefixRecord) + 2*sizeof(PrefixHandle));
+}
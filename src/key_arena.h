@@ -0,0 +1,73 @@
+#ifndef __KEYARENA_H_
+#define __KEYARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace ClassadXrootdMapping {
+
+typedef uint32_t PrefixHandle;
+
+// Hash of a key in place.  Independent of the FNV-1a hash that picks a
+// cache shard, so the index buckets within a shard are not skewed.
+uint32_t hashKey(const char *data, size_t length);
+
+/*
+ * Interned key prefixes for one cache shard: the redirector and directory
+ * of each cached filename, up to and including the last '/'.  Logical
+ * filenames are long and share their directories with hundreds of
+ * siblings, so each entry keeps only a handle here and its basename.
+ *
+ * The characters live in one buffer addressed by offset.  Prefixes are
+ * reference counted; the space of those no longer used is reclaimed by
+ * compacting the buffer once it is mostly dead.  Handles stay valid
+ * across compaction, pointers into the buffer do not.
+ *
+ * Not thread-safe; the shard's lock protects it.
+ */
+class PrefixArena {
+
+public:
+
+	PrefixArena();
+
+	// Takes a reference to the prefix, adding it if it is new.
+	PrefixHandle acquire(const char *data, size_t length);
+	void release(PrefixHandle handle);
+
+	const char *data(PrefixHandle handle) const { return m_chars.data() + m_records[handle].m_offset; }
+	size_t length(PrefixHandle handle) const { return m_records[handle].m_length; }
+
+	// Approximate memory held by the prefixes in use.
+	size_t bytes() const;
+
+	// Where the prefix of a key ends.
+	static size_t split(const char *key, size_t length);
+
+private:
+
+	struct PrefixRecord {
+		uint32_t m_offset;
+		uint32_t m_length;
+		uint32_t m_hash;
+		uint32_t m_refs; // 0 if the record is free.
+	};
+
+	static const PrefixHandle m_empty = static_cast<PrefixHandle>(-1);
+
+	void grow();
+	void compact();
+
+	std::string m_chars;
+	std::vector<PrefixRecord> m_records;
+	std::vector<PrefixHandle> m_free;   // Free records, for reuse.
+	std::vector<PrefixHandle> m_index;  // Open addressing; m_empty marks a free slot.
+	size_t m_live;                      // Records in use.
+	size_t m_dead_chars;                // Characters of released prefixes.
+};
+
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __LOCATEBACKEND_H_
+#define __LOCATEBACKEND_H_
+
+#include <stdint.h>
+#include <string>
+
+#include "XrdCl/XrdClFileSystem.hh"
+
+namespace ClassadXrootdMapping {
+
+/*
+ * Sends the locate requests of every client.  The default implementation
+ * sends them to the redirector over XrdCl; classad_xrootd_mapping_bench
+ * installs an in-process fake redirector instead.
+ */
+class LocateBackend {
+
+public:
+
+	virtual ~LocateBackend() {}
+
+	// Same contract as XrdCl::FileSystem::Locate: unless the returned
+	// status is an error, the handler is called exactly once.  `fs` is
+	// the connection picked for the redirector `host`.
+	virtual XrdCl::XRootDStatus locate(XrdCl::FileSystem &fs, const std::string &host,
+		const std::string &path, XrdCl::ResponseHandler *handler, uint16_t timeout) = 0;
+};
+
+class XrdClBackend : public LocateBackend {
+
+public:
+
+	virtual XrdCl::XRootDStatus locate(XrdCl::FileSystem &fs, const std::string &host,
+		const std::string &path, XrdCl::ResponseHandler *handler, uint16_t timeout);
+};
+
+}
+
+#endif
@@ -0,0 +1,85 @@
+
+#include <algorithm>
+#include <time.h>
+
+#include "manager_cache.h"
+#include "response_cache.h"
+#include "config.h"
+
+using namespace ClassadXrootdMapping;
+
+ManagerCache * ManagerCache::m_instance = NULL;
+pthread_once_t ManagerCache::m_instance_once = PTHREAD_ONCE_INIT;
+
+void
+ManagerCache::createInstance()
+{
+	m_instance = new ManagerCache();
+}
+
+ManagerCache &
+ManagerCache::getInstance()
+{
+	pthread_once(&m_instance_once, createInstance);
+	return *m_instance;
+}
+
+std::string
+ManagerCache::makeKey(RedirectorId redirector, const std::string &filename)
+{
+	size_t slash = filename.rfind('/');
+	return CacheEntry::makeKey(redirector, (slash == std::string::npos) ? std::string() : filename.substr(0, slash + 1));
+}
+
+bool
+ManagerCache::lookup(RedirectorId redirector, const std::string &filename, std::vector<std::string> &managers)
+{
+	std::string key = makeKey(redirector, filename);
+	XrdSysRWLockHelper monitor(m_lock, true);
+	ManagerMap::const_iterator it = m_entries.find(key);
+	if (it == m_entries.end() || it->second.m_expiration <= time(NULL))
+		return false;
+	managers = it->second.m_managers;
+	return true;
+}
+
+void
+ManagerCache::insert(RedirectorId redirector, const std::string &filename, const std::vector<std::string> &managers)
+{
+	std::string key = makeKey(redirector, filename);
+	time_t now = time(NULL);
+
+	XrdSysRWLockHelper monitor(m_lock, false);
+	if (m_entries.size() >= m_max_entries && m_entries.find(key) == m_entries.end())
+	{
+		// Make room by dropping whatever has expired; if nothing has,
+		// the directory is simply not remembered.
+		ManagerMap::iterator it = m_entries.begin();
+		while (it != m_entries.end())
+		{
+			if (it->second.m_expiration <= now)
+				m_entries.erase(it++);
+			else
+				++it;
+		}
+		if (m_entries.size() >= m_max_entries)
+			return;
+	}
+	ManagerEntry &entry = m_entries[key];
+	if (entry.m_expiration <= now)
+		entry.m_managers.clear();
+	for (std::vector<std::string>::const_iterator it = managers.begin(); it != managers.end(); ++it)
+	{
+		if (std::find(entry.m_managers.begin(), entry.m_managers.end(), *it) == entry.m_managers.end())
+			entry.m_managers.push_back(*it);
+	}
+	entry.m_expiration = now + Config::getInstance().m_manager_ttl;
+}
+
+void
+ManagerCache::forget(RedirectorId redirector, const std::string &filename)
+{
+	std::string key = makeKey(redirector, filename);
+	XrdSysRWLockHelper monitor(m_lock, false);
+	m_entries.erase(key);
+}
@@ -0,0 +1,66 @@
+#ifndef __MANAGERCACHE_H_
+#define __MANAGERCACHE_H_
+
+#include <string>
+#include <vector>
+#include "XrdSys/XrdSysPthread.hh"
+
+#include "classad/classad_distribution.h"
+
+#include "host_table.h"
+
+namespace ClassadXrootdMapping {
+
+struct ManagerEntry {
+	ManagerEntry() : m_expiration(0) {}
+
+	std::vector<std::string> m_managers;
+	time_t m_expiration;
+};
+
+typedef classad_unordered<std::string, ManagerEntry> ManagerMap;
+
+/*
+ * Where deep locates found data servers, per redirector and directory:
+ * the managers one level above the servers.  A later lookup in the same
+ * directory asks those managers directly, skipping the levels above them,
+ * until CLASSAD_XROOTD_MANAGER_TTL runs out.
+ *
+ * The files of a directory need not all live below the same managers, so
+ * those found for each file are added to the directory's; its lookups
+ * converge on every manager holding part of it.
+ */
+class ManagerCache {
+
+public:
+
+	static ManagerCache &getInstance();
+
+	bool lookup(RedirectorId redirector, const std::string &filename, std::vector<std::string> &managers);
+
+	void insert(RedirectorId redirector, const std::string &filename, const std::vector<std::string> &managers);
+
+	// Once the managers failed to find a file, the whole directory goes
+	// back to asking the redirector.
+	void forget(RedirectorId redirector, const std::string &filename);
+
+private:
+
+	ManagerCache() {}
+
+	static std::string makeKey(RedirectorId redirector, const std::string &filename);
+
+	static void createInstance();
+
+	static const size_t m_max_entries = 100000;
+
+	ManagerMap m_entries;
+	XrdSysRWLock m_lock;
+
+	static ManagerCache * m_instance;
+	static pthread_once_t m_instance_once;
+};
+
+}
+
+#endif
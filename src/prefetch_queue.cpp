@@ -0,0 +1,161 @@
+
+#include <vector>
+
+#include "prefetch_queue.h"
+#include "xrootd_client.h"
+#include "response_cache.h"
+#include "config.h"
+
+using namespace ClassadXrootdMapping;
+
+PrefetchQueue * PrefetchQueue::m_instance = NULL;
+pthread_once_t PrefetchQueue::m_instance_once = PTHREAD_ONCE_INIT;
+
+PrefetchQueue::PrefetchQueue() :
+	m_completed(0),
+	m_cond(0)
+{
+	pthread_t tid;
+	XrdSysThread::Run(&tid, prefetchThread, this, 0, "Prefetch queue");
+}
+
+void
+PrefetchQueue::createInstance()
+{
+	m_instance = new PrefetchQueue();
+}
+
+PrefetchQueue &
+PrefetchQueue::getInstance()
+{
+	pthread_once(&m_instance_once, createInstance);
+	return *m_instance;
+}
+
+bool
+PrefetchQueue::enqueue(FileMappingClient &client, RedirectorId scope, const std::string &filename, PrefetchPriority priority)
+{
+	PrefetchItem item;
+	item.m_client = &client;
+	item.m_scope = scope;
+	item.m_filename = filename;
+
+	XrdSysCondVarHelper monitor(m_cond);
+	if (m_high.size() + m_low.size() >= Config::getInstance().m_prefetch_queue)
+		return false;
+	client.Acquire();
+	if (priority == PrefetchHigh)
+		m_high.push_back(item);
+	else
+		m_low.push_back(item);
+	m_cond.Signal();
+	return true;
+}
+
+size_t
+PrefetchQueue::enqueue(const std::string &redirector, std::istream &input, PrefetchPriority priority)
+{
+	FileMappingClient *client = FileMappingClient::getClient(redirector);
+	if (!client)
+		return 0;
+
+	size_t queued = 0;
+	std::string line;
+	while (std::getline(input, line))
+	{
+		size_t start = line.find_first_not_of(" \t\r");
+		if (start == std::string::npos || line[start] == '#')
+			continue;
+		size_t end = line.find_last_not_of(" \t\r");
+		if (!enqueue(*client, client->getRedirector(), line.substr(start, end - start + 1), priority))
+			break;
+		queued++;
+	}
+	client->Release();
+	return queued;
+}
+
+void *
+PrefetchQueue::prefetchThread(void *arg)
+{
+	static_cast<PrefetchQueue*>(arg)->prefetchLoop();
+	return NULL;
+}
+
+/*
+ * Called with the request's lock held; the worker never holds m_cond while
+ * it calls into a request, so the two locks are always taken in this order.
+ */
+void
+PrefetchQueue::notify(size_t, bool)
+{
+	XrdSysCondVarHelper monitor(m_cond);
+	m_completed++;
+	m_cond.Signal();
+}
+
+void
+PrefetchQueue::prefetchLoop()
+{
+	const Config &config = Config::getInstance();
+	ResponseCache &cache = ResponseCache::getInstance();
+
+	while (true)
+	{
+		std::vector<PrefetchItem> batch;
+		{
+			XrdSysCondVarHelper monitor(m_cond);
+			while (!m_completed && (m_outstanding.size() >= config.m_prefetch_concurrency ||
+				(m_high.empty() && m_low.empty())))
+				m_cond.Wait();
+			m_completed = 0;
+
+			while (m_outstanding.size() + batch.size() < config.m_prefetch_concurrency &&
+				(!m_high.empty() || !m_low.empty()))
+			{
+				std::deque<PrefetchItem> &queue = m_high.empty() ? m_low : m_high;
+				batch.push_back(queue.front());
+				queue.pop_front();
+			}
+		}
+
+		for (std::vector<PrefetchItem>::const_iterator it = batch.begin(); it != batch.end(); ++it)
+		{
+			// Skip anything that is already known, unless it is due a
+			// refresh.  These checks are not lookups by a caller, so they
+			// are not counted as cache hits or misses.
+			HostSet hosts;
+			bool wanted = !FileMappingClient::lookupCatalog(it->m_filename, hosts) &&
+				cache.needsLookup(it->m_scope, it->m_filename);
+			// Items for a redirector that is down are dropped, and any
+			// refresh they claimed is left to the next lookup.
+			if (wanted && it->m_client->admit())
+			{
+				FileMappingResponseHandler *handler = it->m_client->locate(it->m_scope, it->m_filename);
+				handler->AddWaiter(this, 0);
+				m_outstanding.push_back(handler);
+			}
+			else if (wanted)
+			{
+				cache.abandonRefresh(it->m_scope, std::vector<std::string>(1, it->m_filename));
+			}
+			it->m_client->Release();
+		}
+
+		// Reap whatever finished; each completion woke us above.
+		std::list<FileMappingResponseHandler *>::iterator it = m_outstanding.begin();
+		while (it != m_outstanding.end())
+		{
+			if ((*it)->isValid())
+			{
+				(*it)->RemoveWaiter(this);
+				(*it)->Release();
+				it = m_outstanding.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+}
@@ -0,0 +1,76 @@
+#ifndef __PREFETCHQUEUE_H_
+#define __PREFETCHQUEUE_H_
+
+#include <deque>
+#include <istream>
+#include <list>
+#include <string>
+#include "XrdSys/XrdSysPthread.hh"
+
+#include "host_table.h"
+#include "xrootd_client.h"
+
+namespace ClassadXrootdMapping {
+
+enum PrefetchPriority {
+	PrefetchLow,  // Bulk warming, e.g. from a file of LFNs.
+	PrefetchHigh  // Requested from a ClassAd expression.
+};
+
+struct PrefetchItem {
+	FileMappingClient *m_client; // Holds a reference.
+	RedirectorId m_scope;
+	std::string m_filename;
+};
+
+/*
+ * Background queue of lookups that warm the cache ahead of matchmaking.
+ *
+ * One worker thread drains the queue, high priority first, keeping at most
+ * CLASSAD_XROOTD_PREFETCH_CONCURRENCY prefetches outstanding, so bulk
+ * warming cannot flood the redirector that interactive lookups depend on.
+ * The queue holds at most CLASSAD_XROOTD_PREFETCH_QUEUE files; beyond that,
+ * requests are dropped.  The worker sleeps until a file is queued or one
+ * of its prefetches completes.
+ */
+class PrefetchQueue : public LocateObserver {
+
+public:
+
+	// Returns false if the queue was full.  The answer is cached under `scope`.
+	bool enqueue(FileMappingClient &client, RedirectorId scope, const std::string &filename, PrefetchPriority priority);
+
+	// Queues one LFN per line; blank lines and lines starting with '#' are
+	// skipped.  Returns the number of files queued.
+	size_t enqueue(const std::string &redirector, std::istream &input, PrefetchPriority priority);
+
+	static PrefetchQueue &getInstance();
+
+private:
+
+	PrefetchQueue();
+
+	// Called by the prefetches as they are sent and complete.
+	virtual void add(size_t idx) {}
+	virtual void notify(size_t idx, bool answered);
+
+	void prefetchLoop();
+	static void *prefetchThread(void *);
+
+	static void createInstance();
+
+	std::deque<PrefetchItem> m_high;
+	std::deque<PrefetchItem> m_low;
+	unsigned int m_completed; // Prefetches completed since the worker last looked.
+	XrdSysCondVar m_cond; // Protects the queues and m_completed.
+
+	// Only touched by the worker thread.
+	std::list<FileMappingResponseHandler *> m_outstanding;
+
+	static PrefetchQueue * m_instance;
+	static pthread_once_t m_instance_once;
+};
+
+}
+
+#endif
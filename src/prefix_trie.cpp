@@ -0,0 +1,186 @@
+
+#include "prefix_trie.h"
+
+using namespace ClassadXrootdMapping;
+
+TrieNode::~TrieNode()
+{
+	for (TrieChildren::iterator it = m_children.begin(); it != m_children.end(); ++it)
+	{
+		delete it->second;
+	}
+}
+
+size_t
+PrefixTrie::nodeBytes(const std::string &component)
+{
+	// The node, its slot in the parent's map, and the map's bucket.
+	return sizeof(TrieNode) + sizeof(TrieChildren::value_type) + 3*sizeof(void*) + component.capacity();
+}
+
+size_t
+PrefixTrie::hostBytes(const HostSet &hosts)
+{
+	return hosts.getWords().capacity()*sizeof(uint64_t);
+}
+
+void
+PrefixTrie::addBytes(size_t bytes)
+{
+	AtomicBeg(m_atomic_mutex);
+	AtomicAdd(m_bytes, bytes);
+	AtomicEnd(m_atomic_mutex);
+}
+
+void
+PrefixTrie::subBytes(size_t bytes)
+{
+	AtomicBeg(m_atomic_mutex);
+	AtomicSub(m_bytes, bytes);
+	AtomicEnd(m_atomic_mutex);
+}
+
+size_t
+PrefixTrie::bytes()
+{
+	AtomicBeg(m_atomic_mutex);
+	size_t bytes = AtomicGet(m_bytes);
+	AtomicEnd(m_atomic_mutex);
+	return bytes;
+}
+
+void
+PrefixTrie::learn(const std::string &filename, const HostSet &hosts, time_t now, time_t expiration, size_t budget)
+{
+	size_t dir_end = filename.rfind('/');
+	if (dir_end == std::string::npos)
+		return;
+
+	XrdSysRWLockHelper monitor(m_lock, false);
+
+	// Make room for the whole path up front, so the walk below never has
+	// to start over.
+	size_t needed = hostBytes(hosts) + nodeBytes(filename.substr(0, dir_end));
+	if (bytes() + needed > budget)
+	{
+		reap(&m_root, now);
+		if (bytes() + needed > budget)
+			clear();
+	}
+
+	TrieNode *node = &m_root;
+	size_t start = 0;
+	while (start < dir_end)
+	{
+		size_t end = filename.find('/', start);
+		if (end > dir_end)
+			end = dir_end;
+		if (end == start)
+		{
+			start++;
+			continue;
+		}
+
+		std::string component = filename.substr(start, end - start);
+		TrieChildren::const_iterator it = node->m_children.find(component);
+		if (it != node->m_children.end())
+		{
+			node = it->second;
+		}
+		else
+		{
+			TrieNode *child = new TrieNode();
+			node->m_children[component] = child;
+			addBytes(nodeBytes(component));
+			node = child;
+		}
+		start = end + 1;
+	}
+	subBytes(hostBytes(node->m_hosts));
+	node->m_hosts = hosts;
+	addBytes(hostBytes(node->m_hosts));
+	node->m_expiration = expiration;
+}
+
+bool
+PrefixTrie::guess(const std::string &filename, HostSet &hosts, time_t now)
+{
+	size_t dir_end = filename.rfind('/');
+	if (dir_end == std::string::npos)
+		return false;
+
+	XrdSysRWLockHelper monitor(m_lock, true);
+
+	// Only the file's own directory counts; a parent's answer says little
+	// about the datasets below it.
+	const TrieNode *node = &m_root;
+	size_t start = 0;
+	while (start < dir_end)
+	{
+		size_t end = filename.find('/', start);
+		if (end > dir_end)
+			end = dir_end;
+		if (end == start)
+		{
+			start++;
+			continue;
+		}
+
+		TrieChildren::const_iterator it = node->m_children.find(filename.substr(start, end - start));
+		if (it == node->m_children.end())
+			return false;
+		node = it->second;
+		start = end + 1;
+	}
+
+	if (node->m_expiration <= now)
+		return false;
+	hosts.merge(node->m_hosts);
+	return true;
+}
+
+void
+PrefixTrie::reap(time_t now)
+{
+	XrdSysRWLockHelper monitor(m_lock, false);
+	reap(&m_root, now);
+}
+
+bool
+PrefixTrie::reap(TrieNode *node, time_t now)
+{
+	for (TrieChildren::iterator it = node->m_children.begin(); it != node->m_children.end(); )
+	{
+		if (reap(it->second, now))
+		{
+			subBytes(nodeBytes(it->first) + hostBytes(it->second->m_hosts));
+			delete it->second;
+			node->m_children.erase(it++);
+		}
+		else
+			++it;
+	}
+	if (node->m_expiration && node->m_expiration <= now)
+	{
+		// Keep the node for its children, but not the stale answer.
+		subBytes(hostBytes(node->m_hosts));
+		HostSet().swap(node->m_hosts);
+		node->m_expiration = 0;
+	}
+	return !node->m_expiration && node->m_children.empty();
+}
+
+void
+PrefixTrie::clear()
+{
+	for (TrieChildren::iterator it = m_root.m_children.begin(); it != m_root.m_children.end(); ++it)
+	{
+		delete it->second;
+	}
+	m_root.m_children.clear();
+	HostSet().swap(m_root.m_hosts);
+	m_root.m_expiration = 0;
+	AtomicBeg(m_atomic_mutex);
+	AtomicZAP(m_bytes);
+	AtomicEnd(m_atomic_mutex);
+}
@@ -0,0 +1,79 @@
+#ifndef __PREFIXTRIE_H_
+#define __PREFIXTRIE_H_
+
+#include <string>
+#include "XrdSys/XrdSysPthread.hh"
+#include "XrdSys/XrdSysAtomics.hh"
+
+#include "classad/classad_distribution.h"
+
+#include "host_table.h"
+
+namespace ClassadXrootdMapping {
+
+class TrieNode;
+
+typedef classad_unordered<std::string, TrieNode*> TrieChildren;
+
+class TrieNode {
+
+friend class PrefixTrie;
+
+private:
+
+	TrieNode() : m_expiration(0) {}
+	~TrieNode();
+
+	TrieChildren m_children; // Keyed by the next path component.
+	HostSet m_hosts;     // Replica set of the last file found directly in this directory.
+	time_t m_expiration; // 0 if no file in this directory was found yet.
+};
+
+/*
+ * Trie of directory prefixes, learning the replica set of each directory.
+ *
+ * In CMS-style namespaces, the files of one /store/.../<dataset>/<block>/
+ * directory almost always share their replicas, so the answer for one file
+ * is a good provisional answer for its siblings while they are located.
+ */
+class PrefixTrie {
+
+public:
+
+	PrefixTrie() : m_bytes(0) {}
+
+	// Records the complete answer for a file that was found.  If the trie
+	// would outgrow `budget` bytes, expired directories are dropped first,
+	// and if that is not enough, everything learned so far.
+	void learn(const std::string &filename, const HostSet &hosts, time_t now, time_t expiration, size_t budget);
+
+	// Merges the answer for the file's own directory, if one is known.
+	bool guess(const std::string &filename, HostSet &hosts, time_t now);
+
+	// Drops the directories whose answers have expired at `now`.
+	void reap(time_t now);
+
+	// Approximate memory held by the trie.
+	size_t bytes();
+
+private:
+
+	// Returns true if `node` is left without an answer or children.
+	bool reap(TrieNode *node, time_t now);
+	void clear();
+
+	void addBytes(size_t bytes);
+	void subBytes(size_t bytes);
+
+	static size_t nodeBytes(const std::string &component);
+	static size_t hostBytes(const HostSet &hosts);
+
+	TrieNode m_root;
+	size_t m_bytes; // Changed under m_lock, but read without it.
+	XrdSysRWLock m_lock;
+	XrdSysMutex m_atomic_mutex; // Only used where there are no atomics.
+};
+
+}
+
+#endif
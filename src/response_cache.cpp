@@ -1,26 +1,78 @@
+#include <algorithm>
 
+#include <cstring>
+#include <new>
 #include <sstream>
+#include <stdint.h>
 #include <vector>
 
 #include "XrdSys/XrdSysPthread.hh"
+#include "XrdSys/XrdSysTimer.hh"
 #include "response_cache.h"
+#include "cache_snapshot.h"
+#include "config.h"
+#include "stats.h"
 
 using namespace classad;
 using namespace ClassadXrootdMapping;
 
 ResponseCache * ResponseCache::m_instance = NULL;
-XrdSysMutex ResponseCache::m_instance_mutex;
+pthread_once_t ResponseCache::m_instance_once = PTHREAD_ONCE_INIT;
 
-const unsigned int ResponseCache::m_lifetime_seconds = 15*60; // defaults to 15 minutes.
+CacheEntry::CacheEntry(PrefixHandle prefix, uint32_t hash, LookupOutcome outcome, const HostSet &hosts)
+	: m_prefix(prefix),
+	  m_hash(hash),
+	  m_name_length(0),
+	  m_expiration(0),
+	  m_stale_until(0),
+	  m_set(hosts),
+	  m_outcome(outcome),
+	  m_streak(0),
+	  m_referenced(0),
+	  m_refreshing(0),
+	  m_wheel_prev(NULL),
+	  m_wheel_next(NULL),
+	  m_queue_prev(NULL),
+	  m_queue_next(NULL),
+	  m_queue(NULL)
+{
+}
+
+CacheEntry *
+CacheEntry::create(PrefixHandle prefix, uint32_t hash, const char *name, size_t length,
+	LookupOutcome outcome, const HostSet &hosts)
+{
+	void *memory = ::operator new(sizeof(CacheEntry) + length);
+	CacheEntry *entry = new (memory) CacheEntry(prefix, hash, outcome, hosts);
+	memcpy(entry->m_name, name, length);
+	entry->m_name_length = length;
+	return entry;
+}
 
-CacheEntry::CacheEntry(const std::string & filename, const std::set<std::string> &hosts, time_t expiration, ResponseCache &cache)
-	: m_filename(filename),
-	  m_expiration(expiration)
+void
+CacheEntry::destroy(CacheEntry *entry)
+{
+	entry->~CacheEntry();
+	::operator delete(entry);
+}
+
+bool
+CacheEntry::matches(const char *key, size_t length, const PrefixArena &prefixes) const
 {
-	m_set.insert(hosts.begin(), hosts.end());
+	size_t prefix_length = prefixes.length(m_prefix);
+	return length == prefix_length + m_name_length &&
+		!memcmp(key + prefix_length, m_name, m_name_length) &&
+		!memcmp(key, prefixes.data(m_prefix), prefix_length);
 }
 
-const std::set<std::string> &
+void
+CacheEntry::getKey(const PrefixArena &prefixes, std::string &key) const
+{
+	key.assign(prefixes.data(m_prefix), prefixes.length(m_prefix));
+	key.append(m_name, m_name_length);
+}
+
+const HostSet &
 CacheEntry::getSet() const
 {
 	return m_set;
@@ -32,115 +84,913 @@ CacheEntry::isValid(time_t now) const
 	return now < m_expiration;
 }
 
+bool
+CacheEntry::isStale(time_t now) const
+{
+	return now >= m_expiration && now < m_stale_until;
+}
+
+size_t
+CacheEntry::memoryUsage() const
+{
+	// The index is kept at most three quarters full; call it two slots.
+	return sizeof(CacheEntry) + m_name_length + 2*sizeof(CacheEntry*) +
+		m_set.getWords().capacity()*sizeof(uint64_t);
+}
+
+size_t
+CacheEntry::createHash(const HostSet &hosts)
+{
+	const std::vector<uint64_t> &words = hosts.getWords();
+	uint64_t hash = 14695981039346656037ULL;
+	for (std::vector<uint64_t>::const_iterator it = words.begin(); it != words.end(); ++it)
+	{
+		hash ^= *it;
+		hash *= 1099511628211ULL;
+	}
+	return static_cast<size_t>(hash ^ (hash >> 32));
+}
+
+std::string
+CacheEntry::makeKey(RedirectorId redirector, const std::string &filename)
+{
+	std::string key;
+	makeKey(redirector, filename, key);
+	return key;
+}
+
+void
+CacheEntry::makeKey(RedirectorId redirector, const std::string &filename, std::string &key)
+{
+	static const char digits[] = "0123456789abcdef";
+	char prefix[sizeof(RedirectorId)*2 + 1];
+	char *start = prefix + sizeof(prefix);
+	*--start = ':';
+	do
+	{
+		*--start = digits[redirector & 0xf];
+		redirector >>= 4;
+	} while (redirector);
+
+	key.assign(start, prefix + sizeof(prefix) - start);
+	key += filename;
+}
+
+bool
+CacheEntry::splitKey(const std::string &key, RedirectorId &redirector, std::string &filename)
+{
+	size_t colon = key.find(':');
+	if (colon == std::string::npos || colon == 0 || colon > sizeof(RedirectorId)*2)
+		return false;
+	redirector = 0;
+	for (size_t idx = 0; idx < colon; idx++)
+	{
+		char digit = key[idx];
+		redirector <<= 4;
+		if (digit >= '0' && digit <= '9')
+			redirector |= digit - '0';
+		else if (digit >= 'a' && digit <= 'f')
+			redirector |= digit - 'a' + 10;
+		else
+			return false;
+	}
+	filename.assign(key, colon + 1, std::string::npos);
+	return true;
+}
+
+size_t
+HostSetHash::operator()(const HostSet &hosts) const
+{
+	return CacheEntry::createHash(hosts);
+}
+
+ExpiryWheel::ExpiryWheel()
+{
+	for (unsigned int idx = 0; idx < m_slot_count; idx++)
+	{
+		m_slots[idx] = NULL;
+	}
+}
+
+void
+ExpiryWheel::add(CacheEntry *entry)
+{
+	CacheEntry *&head = m_slots[entry->m_stale_until % m_slot_count];
+	entry->m_wheel_prev = NULL;
+	entry->m_wheel_next = head;
+	if (head)
+		head->m_wheel_prev = entry;
+	head = entry;
+}
+
+void
+ExpiryWheel::remove(CacheEntry *entry)
+{
+	if (entry->m_wheel_prev)
+		entry->m_wheel_prev->m_wheel_next = entry->m_wheel_next;
+	else
+		m_slots[entry->m_stale_until % m_slot_count] = entry->m_wheel_next;
+	if (entry->m_wheel_next)
+		entry->m_wheel_next->m_wheel_prev = entry->m_wheel_prev;
+	entry->m_wheel_prev = NULL;
+	entry->m_wheel_next = NULL;
+}
+
+void
+ExpiryWheel::expire(time_t second, time_t now, std::vector<CacheEntry*> &expired)
+{
+	for (CacheEntry *entry = m_slots[second % m_slot_count]; entry; entry = entry->m_wheel_next)
+	{
+		if (now >= entry->m_stale_until)
+		{
+			expired.push_back(entry);
+		}
+	}
+}
+
+void
+EvictionQueue::push_back(CacheEntry *entry)
+{
+	entry->m_queue = this;
+	entry->m_queue_prev = m_tail;
+	entry->m_queue_next = NULL;
+	if (m_tail)
+		m_tail->m_queue_next = entry;
+	else
+		m_head = entry;
+	m_tail = entry;
+	m_bytes += entry->memoryUsage();
+}
+
+void
+EvictionQueue::remove(CacheEntry *entry)
+{
+	if (entry->m_queue_prev)
+		entry->m_queue_prev->m_queue_next = entry->m_queue_next;
+	else
+		m_head = entry->m_queue_next;
+	if (entry->m_queue_next)
+		entry->m_queue_next->m_queue_prev = entry->m_queue_prev;
+	else
+		m_tail = entry->m_queue_prev;
+	entry->m_queue = NULL;
+	entry->m_queue_prev = NULL;
+	entry->m_queue_next = NULL;
+	m_bytes -= entry->memoryUsage();
+}
+
+CacheEntry *
+ResponseIndex::find(const char *key, size_t length, uint32_t hash, const PrefixArena &prefixes) const
+{
+	if (m_slots.empty())
+		return NULL;
+
+	size_t mask = m_slots.size() - 1;
+	for (size_t slot = hash & mask; m_slots[slot]; slot = (slot + 1) & mask)
+	{
+		CacheEntry *entry = m_slots[slot];
+		if (entry->m_hash == hash && entry->matches(key, length, prefixes))
+			return entry;
+	}
+	return NULL;
+}
+
+void
+ResponseIndex::insert(CacheEntry *entry)
+{
+	// Keep the index at most three quarters full.
+	if ((m_size + 1) * 4 > m_slots.size() * 3)
+		grow();
+
+	size_t mask = m_slots.size() - 1;
+	size_t slot = entry->m_hash & mask;
+	while (m_slots[slot])
+	{
+		slot = (slot + 1) & mask;
+	}
+	m_slots[slot] = entry;
+	m_size++;
+}
+
+void
+ResponseIndex::erase(CacheEntry *entry)
+{
+	// As in PrefixArena::release, shift the rest of the cluster back over
+	// the hole rather than leave a tombstone.
+	size_t mask = m_slots.size() - 1;
+	size_t hole = entry->m_hash & mask;
+	while (m_slots[hole] != entry)
+	{
+		hole = (hole + 1) & mask;
+	}
+	for (size_t slot = (hole + 1) & mask; m_slots[slot]; slot = (slot + 1) & mask)
+	{
+		size_t home = m_slots[slot]->m_hash & mask;
+		bool movable = (hole <= slot) ? (home <= hole || home > slot) : (home <= hole && home > slot);
+		if (movable)
+		{
+			m_slots[hole] = m_slots[slot];
+			hole = slot;
+		}
+	}
+	m_slots[hole] = NULL;
+	m_size--;
+}
+
+void
+ResponseIndex::grow()
+{
+	std::vector<CacheEntry *> slots(m_slots.empty() ? 64 : m_slots.size() * 2, static_cast<CacheEntry *>(NULL));
+	size_t mask = slots.size() - 1;
+	for (std::vector<CacheEntry *>::const_iterator it = m_slots.begin(); it != m_slots.end(); ++it)
+	{
+		if (!*it)
+			continue;
+		size_t slot = (*it)->m_hash & mask;
+		while (slots[slot])
+		{
+			slot = (slot + 1) & mask;
+		}
+		slots[slot] = *it;
+	}
+	m_slots.swap(slots);
+}
+
+const CacheEntry *
+CacheShard::find(const char *key, size_t length) const
+{
+	CacheEntry *entry = m_index.find(key, length, hashKey(key, length), m_prefixes);
+	if (!entry)
+		return NULL;
+
+	// Only the first hit since the last eviction scan pays for an atomic write.
+	if (!entry->m_referenced)
+	{
+		AtomicBeg(m_atomic_mutex);
+		AtomicInc(entry->m_referenced);
+		AtomicEnd(m_atomic_mutex);
+	}
+	return entry;
+}
+
+bool
+CacheShard::claimRefresh(const CacheEntry *entry) const
+{
+	// Cheap check first; most readers of a stale entry are not the first.
+	if (entry->m_refreshing)
+		return false;
+	int refreshing;
+	AtomicBeg(m_atomic_mutex);
+	refreshing = AtomicInc(entry->m_refreshing);
+	AtomicEnd(m_atomic_mutex);
+	return !refreshing;
+}
+
+void
+CacheShard::releaseRefresh(const CacheEntry *entry) const
+{
+	AtomicBeg(m_atomic_mutex);
+	AtomicZAP(entry->m_refreshing);
+	AtomicEnd(m_atomic_mutex);
+}
+
+/*
+ * Must be called with the shard locked for writing.
+ */
+bool
+CacheShard::insert(const std::string &key, LookupOutcome outcome, const HostSet &hosts,
+	time_t now, unsigned int lifetime, unsigned int max_lifetime, size_t budget)
+{
+	bool changed = false;
+	uint32_t hash = hashKey(key.data(), key.size());
+	CacheEntry *entry = m_index.find(key.data(), key.size(), hash, m_prefixes);
+	if (entry)
+	{
+		// Update in place; the entry keeps its place in probation or main.
+		// Hedged requests race each other; a redirector that failed or
+		// lacks the file must not undo another's answer that found it.
+		if (entry->m_outcome == LookupFound && outcome != LookupFound && entry->isValid(now))
+			return false;
+		// Nor may a failed refresh throw away a stale list of sites; the
+		// list is kept for the rest of its grace period, and a later
+		// reader may try the refresh again.
+		if (entry->m_outcome == LookupFound && (outcome == LookupError || outcome == LookupTimedOut) &&
+			entry->isStale(now))
+		{
+			entry->m_refreshing = 0;
+			return false;
+		}
+		changed = entry->m_outcome != outcome || !(entry->m_set == hosts);
+		EvictionQueue *queue = entry->m_queue;
+		m_wheel.remove(entry);
+		m_bytes -= entry->memoryUsage();
+		queue->remove(entry);
+		entry->m_set = hosts;
+		entry->m_streak = (entry->m_outcome == outcome) ? entry->m_streak + 1 : 0;
+		entry->m_outcome = outcome;
+		entry->m_refreshing = 0;
+		queue->push_back(entry);
+	}
+	else
+	{
+		size_t split = PrefixArena::split(key.data(), key.size());
+		PrefixHandle prefix = m_prefixes.acquire(key.data(), split);
+		entry = CacheEntry::create(prefix, hash, key.data() + split, key.size() - split, outcome, hosts);
+		m_index.insert(entry);
+		m_probation.push_back(entry);
+	}
+	m_bytes += entry->memoryUsage();
+
+	// Back off exponentially while the outcome keeps repeating.
+	for (unsigned int idx = 0; idx < entry->m_streak && lifetime < max_lifetime; idx++)
+	{
+		lifetime *= 2;
+	}
+	if (lifetime > max_lifetime)
+	{
+		lifetime = max_lifetime;
+	}
+	entry->m_expiration = now + lifetime;
+	// Replica sets change slowly, so an old list of sites beats a stall.
+	// Anything else is not worth serving past its lifetime.
+	entry->m_stale_until = entry->m_expiration;
+	if (outcome == LookupFound)
+		entry->m_stale_until += Config::getInstance().m_stale_grace;
+	m_wheel.add(entry);
+
+	// An entry evicted and later inserted again with other hosts must
+	// invalidate whatever was built from it, just as a change in place.
+	return evict(budget) || changed;
+}
+
+size_t
+CacheShard::evict(size_t budget)
+{
+	size_t evicted = 0;
+	size_t probation_budget = budget / 100 * m_probation_percent;
+
+	while (bytes() > budget && (m_probation.front() || m_main.front()))
+	{
+		CacheEntry *victim;
+		int referenced;
+		bool from_probation = m_probation.front() &&
+			(m_probation.bytes() > probation_budget || !m_main.front());
+
+		victim = from_probation ? m_probation.front() : m_main.front();
+		victim->m_queue->remove(victim);
+
+		AtomicBeg(m_atomic_mutex);
+		referenced = AtomicFAZ(victim->m_referenced);
+		AtomicEnd(m_atomic_mutex);
+
+		if (referenced)
+		{
+			// Promote out of probation, or give a second chance in main.
+			m_main.push_back(victim);
+			continue;
+		}
+		erase(victim);
+		evicted++;
+		Stats::getInstance().inc(StatCacheEvictions);
+	}
+	return evicted;
+}
+
+void
+CacheShard::erase(CacheEntry *entry)
+{
+	if (entry->m_queue)
+		entry->m_queue->remove(entry);
+	m_wheel.remove(entry);
+	m_bytes -= entry->memoryUsage();
+	m_index.erase(entry);
+	m_prefixes.release(entry->m_prefix);
+	CacheEntry::destroy(entry);
+}
+
+/*
+ * Must be called with the shard locked, at least for reading.
+ */
+void
+CacheShard::collect(time_t now, std::vector<SnapshotItem> &items) const
+{
+	std::string key;
+	const std::vector<CacheEntry *> &slots = m_index.slots();
+	for (std::vector<CacheEntry *>::const_iterator it = slots.begin(); it != slots.end(); ++it)
+	{
+		if (!*it || !(*it)->isValid(now))
+			continue;
+		const CacheEntry &entry = **it;
+
+		SnapshotItem item;
+		entry.getKey(m_prefixes, key);
+		if (!CacheEntry::splitKey(key, item.m_redirector, item.m_filename))
+			continue;
+		item.m_outcome = entry.m_outcome;
+		item.m_expiration = entry.m_expiration;
+		item.m_hosts = entry.m_set;
+		items.push_back(item);
+	}
+}
+
+/*
+ * Must be called with the shard locked for writing.
+ */
+bool
+CacheShard::expire(time_t second, time_t now)
+{
+	std::vector<CacheEntry*> expired;
+	m_wheel.expire(second, now, expired);
+	for (std::vector<CacheEntry*>::const_iterator it = expired.begin(); it != expired.end(); ++it)
+	{
+		erase(*it);
+	}
+	if (!expired.empty())
+		Stats::getInstance().inc(StatCacheExpirations, expired.size());
+	return !expired.empty();
+}
+
 ResponseCache::ResponseCache() :
-	m_last_pruning(time(0)),
-	m_table_mutex()
-{}
+	m_table_bytes(0),
+	m_stamp(0),
+	m_snapshot(NULL)
+{
+	const Config &config = Config::getInstance();
+
+	pthread_t tid;
+	XrdSysThread::Run(&tid, reaperThread, this, 0, "Response cache reaper");
+
+	if (!config.m_snapshot_path.empty())
+	{
+		m_snapshot = MappedSnapshot::open(config.m_snapshot_path);
+		XrdSysThread::Run(&tid, snapshotThread, this, 0, "Response cache snapshot");
+	}
+}
+
+void
+ResponseCache::createInstance()
+{
+	m_instance = new ResponseCache();
+}
 
 ResponseCache &
 ResponseCache::getInstance()
 {
-	XrdSysMutexHelper monitor(m_instance_mutex);
+	// Only the first call synchronizes; afterward this is a plain load.
+	pthread_once(&m_instance_once, createInstance);
+	return *m_instance;
+}
 
-	if (m_instance == NULL) {
-		m_instance = new ResponseCache();
+CacheShard &
+ResponseCache::getShard(const std::string &key)
+{
+	// FNV-1a; the shard must not correlate with the map's own bucket choice.
+	uint32_t shard_hash = 2166136261U;
+	for (std::string::const_iterator it = key.begin(); it != key.end(); ++it)
+	{
+		shard_hash ^= static_cast<unsigned char>(*it);
+		shard_hash *= 16777619U;
 	}
-	return *m_instance;
+	return m_shards[shard_hash % m_shard_count];
 }
 
-classad_shared_ptr<ExprList>
-ResponseCache::query(std::vector<std::string> &filenames, std::vector<std::string> &files_remaining)
+void
+ResponseCache::query(RedirectorId redirector, std::vector<std::string> &filenames, HostSet &hosts,
+	std::vector<std::string> &files_remaining, std::vector<std::string> &files_to_refresh,
+	CacheFootprint *footprint, std::vector<HostSet> *file_hosts)
 {
 	time_t now = time(NULL);
+	size_t first_remaining = files_remaining.size();
+	unsigned long long stale_hits = 0;
+	// Where each miss came from, to place what the snapshot has for it.
+	std::vector<size_t> miss_positions;
 
-	// Always prune, since we can't do it automatically
-	prune(now);
-
-	std::set<std::string> hosts;
+	// One buffer for every key, so a query allocates nothing per file.
+	std::string key = CacheEntry::makeKey(redirector, "");
+	size_t prefix_length = key.size();
+	for (size_t idx = 0; idx < filenames.size(); idx++)
 	{
-	XrdSysMutexHelper monitor(m_instance_mutex);
+		key.resize(prefix_length);
+		key += filenames[idx];
+		CacheShard &shard = getShard(key);
+		CountingRWLockHelper monitor(shard.m_lock, true);
 
-	for (std::vector<std::string>::const_iterator it = filenames.begin(); it != filenames.end(); ++it)
-	{
-		ResponseMap::iterator map_it = m_response_map.find(*it);
-		if (map_it == m_response_map.end()) {
-			files_remaining.push_back(*it);
+		const CacheEntry *entry = shard.find(key.data(), key.size());
+		if (!entry || !(entry->isValid(now) || entry->isStale(now)))
+		{
+			files_remaining.push_back(filenames[idx]);
+			if (file_hosts)
+				miss_positions.push_back(idx);
+			if (footprint)
+				footprint->m_complete = false;
 			continue;
 		}
+		if (!entry->isValid(now))
+		{
+			stale_hits++;
+			if (shard.claimRefresh(entry))
+				files_to_refresh.push_back(filenames[idx]);
+			if (footprint)
+				footprint->m_complete = false;
+		}
+		else if (footprint)
+		{
+			footprint->m_shards |= static_cast<uint64_t>(1) << (&shard - m_shards);
+			if (!footprint->m_expiration || entry->getExpiration() < footprint->m_expiration)
+				footprint->m_expiration = entry->getExpiration();
+		}
+
+		hosts.merge(entry->getSet());
+		if (file_hosts)
+			(*file_hosts)[idx].merge(entry->getSet());
+	}
 
-		const CacheEntry & entry = *(map_it->second);
-		if (!entry.isValid(now))
+	size_t misses = files_remaining.size() - first_remaining;
+	if (m_snapshot && misses)
+	{
+		std::vector<HostSet> restored;
+		if (file_hosts)
+			restored.resize(misses);
+		restore(redirector, files_remaining, first_remaining, hosts, now, file_hosts ? &restored : NULL);
+		for (size_t idx = 0; idx < restored.size(); idx++)
 		{
-			files_remaining.push_back(*it);
-			continue;
+			(*file_hosts)[miss_positions[idx]].merge(restored[idx]);
 		}
+	}
+
+	Stats &stats = Stats::getInstance();
+	stats.inc(StatCacheHits, filenames.size() - misses);
+	if (stale_hits)
+		stats.inc(StatCacheStaleHits, stale_hits);
+	if (misses)
+		stats.inc(StatCacheMisses, misses);
+}
 
-		const std::set<std::string> &file_hosts = entry.getSet();
-		hosts.insert(file_hosts.begin(), file_hosts.end());
+void
+ResponseCache::abandonRefresh(RedirectorId redirector, const std::vector<std::string> &filenames)
+{
+	time_t now = time(NULL);
+	std::string key;
+	for (std::vector<std::string>::const_iterator it = filenames.begin(); it != filenames.end(); ++it)
+	{
+		CacheEntry::makeKey(redirector, *it, key);
+		CacheShard &shard = getShard(key);
+		CountingRWLockHelper monitor(shard.m_lock, true);
+
+		const CacheEntry *entry = shard.find(key.data(), key.size());
+		if (entry && entry->isStale(now))
+			shard.releaseRefresh(entry);
 	}
+}
+
+bool
+ResponseCache::needsLookup(RedirectorId redirector, const std::string &filename)
+{
+	time_t now = time(NULL);
+	std::string key = CacheEntry::makeKey(redirector, filename);
+	{
+		CacheShard &shard = getShard(key);
+		CountingRWLockHelper monitor(shard.m_lock, true);
+
+		const CacheEntry *entry = shard.find(key.data(), key.size());
+		if (entry && entry->isValid(now))
+			return false;
+		if (entry && entry->isStale(now))
+			return shard.claimRefresh(entry);
 	}
 
-	return getList(hosts);
+	if (!m_snapshot)
+		return true;
+	std::vector<std::string> filenames(1, filename);
+	HostSet hosts;
+	restore(redirector, filenames, 0, hosts, now);
+	return !filenames.empty();
 }
 
 void
-ResponseCache::prune(time_t now)
+ResponseCache::guess(RedirectorId redirector, std::vector<std::string> &files_to_query, HostSet &hosts,
+	std::vector<std::string> &files_guessed, std::vector<HostSet> *file_hosts)
 {
-	XrdSysMutexHelper monitor(m_instance_mutex);
+	time_t now = time(NULL);
 
-	// Do not prune too frequently.
-	if (now - m_last_pruning < 60)
+	std::vector<std::string>::iterator keep = files_to_query.begin();
+	for (std::vector<std::string>::iterator it = files_to_query.begin(); it != files_to_query.end(); ++it)
 	{
+		HostSet &guessed = file_hosts ? (*file_hosts)[it - files_to_query.begin()] : hosts;
+		if (m_prefixes.guess(CacheEntry::makeKey(redirector, *it), guessed, now))
+		{
+			if (file_hosts)
+				hosts.merge(guessed);
+			files_guessed.push_back(*it);
+			continue;
+		}
+		if (keep != it)
+			keep->swap(*it);
+		++keep;
+	}
+	if (keep != files_to_query.end())
+		Stats::getInstance().inc(StatGuesses, files_to_query.end() - keep);
+	files_to_query.erase(keep, files_to_query.end());
+}
+
+/*
+ * Look up misses in the startup snapshot; answers found there are copied
+ * into the cache and removed from `filenames`.  `file_hosts`, if given,
+ * is sized like the misses from `first` on, as they were before.
+ */
+void
+ResponseCache::restore(RedirectorId redirector, std::vector<std::string> &filenames, size_t first, HostSet &hosts, time_t now,
+	std::vector<HostSet> *file_hosts)
+{
+	XrdSysRWLockHelper monitor(m_snapshot_lock, true);
+	if (!m_snapshot)
 		return;
+
+	std::vector<std::string>::iterator keep = filenames.begin() + first;
+	for (std::vector<std::string>::iterator it = keep; it != filenames.end(); ++it)
+	{
+		LookupOutcome outcome;
+		time_t expiration;
+		HostSet restored;
+		if (!m_snapshot->lookup(redirector, *it, outcome, expiration, restored) || expiration <= now)
+		{
+			if (keep != it)
+				keep->swap(*it);
+			++keep;
+			continue;
+		}
+		unsigned int lifetime = expiration - now;
+		// Only the answer was saved, not whether it was complete.
+		insert(CacheEntry::makeKey(redirector, *it), outcome, restored, now, lifetime, lifetime, false);
+		hosts.merge(restored);
+		if (file_hosts)
+			(*file_hosts)[it - filenames.begin() - first].merge(restored);
 	}
+	if (keep != filenames.end())
+		Stats::getInstance().inc(StatSnapshotHits, filenames.end() - keep);
+	filenames.erase(keep, filenames.end());
+}
 
-	ResponseMap::iterator it;
-	for (it = m_response_map.begin(); it != m_response_map.end(); ++it)
+void *
+ResponseCache::snapshotThread(void *arg)
+{
+	static_cast<ResponseCache*>(arg)->snapshotLoop();
+	return NULL;
+}
+
+void
+ResponseCache::snapshotLoop()
+{
+	const Config &config = Config::getInstance();
+	while (true)
 	{
-		if (!it->second->isValid(now))
+		XrdSysTimer::Wait(config.m_snapshot_interval*1000);
+		time_t now = time(NULL);
+
+		std::vector<SnapshotItem> items;
+		for (unsigned int idx = 0; idx < m_shard_count; idx++)
+		{
+			XrdSysRWLockHelper monitor(m_shards[idx].m_lock, true);
+			m_shards[idx].collect(now, items);
+		}
+		MappedSnapshot::write(config.m_snapshot_path, items);
+
+		// Everything in the startup snapshot is in the cache or stale by now.
+		XrdSysRWLockHelper monitor(m_snapshot_lock, false);
+		if (m_snapshot && m_snapshot->getMaxExpiration() <= now)
+		{
+			delete m_snapshot;
+			m_snapshot = NULL;
+		}
+	}
+}
+
+void *
+ResponseCache::reaperThread(void *arg)
+{
+	static_cast<ResponseCache*>(arg)->reapLoop();
+	return NULL;
+}
+
+/*
+ * Expire entries in the background, one wheel slot per second, so that
+ * query() never has to scan the cache.  The trie's expired directories go
+ * less often, as finding them takes a walk over the whole trie.
+ */
+void
+ResponseCache::reapLoop()
+{
+	time_t last_second = time(NULL);
+	time_t next_trie_reap = last_second + m_trie_reap_interval;
+	while (true)
+	{
+		XrdSysTimer::Wait(1000);
+		time_t now = time(NULL);
+
+		// After a long stall, one pass over every slot is enough.
+		if (now - last_second > static_cast<time_t>(ExpiryWheel::m_slot_count))
 		{
-			delete it->second;
-			it->second = NULL;
-			m_response_map.erase(it);
+			last_second = now - ExpiryWheel::m_slot_count;
+		}
+		for (time_t second = last_second + 1; second <= now; second++)
+		{
+			for (unsigned int idx = 0; idx < m_shard_count; idx++)
+			{
+				XrdSysRWLockHelper monitor(m_shards[idx].m_lock, false);
+				if (m_shards[idx].expire(second, now))
+					touch(m_shards[idx]);
+			}
+		}
+		if (now > last_second)
+		{
+			last_second = now;
+		}
+
+		if (now >= next_trie_reap)
+		{
+			m_prefixes.reap(now);
+			next_trie_reap = now + m_trie_reap_interval;
 		}
 	}
 }
 
 void
-ResponseCache::insert(const std::string &filename, const std::set<std::string> & hosts)
+ResponseCache::insert(RedirectorId redirector, const std::string &filename, LookupOutcome outcome, const HostSet & hosts)
 {
-	XrdSysMutexHelper monitor(m_instance_mutex);
+	insert(redirector, filename, outcome, hosts, static_cast<unsigned int>(-1), true);
+}
 
+void
+ResponseCache::insert(RedirectorId redirector, const std::string &filename, LookupOutcome outcome, const HostSet & hosts,
+	unsigned int max_lifetime)
+{
+	insert(redirector, filename, outcome, hosts, max_lifetime, false);
+}
+
+void
+ResponseCache::insert(RedirectorId redirector, const std::string &filename, LookupOutcome outcome, const HostSet & hosts,
+	unsigned int max_lifetime, bool complete)
+{
 	time_t now = time(NULL);
-	CacheEntry *entry = new CacheEntry(filename, hosts, now+m_lifetime_seconds, *this);
-	m_response_map[filename] = entry;
+	const Config &config = Config::getInstance();
+
+	unsigned int lifetime = 0, outcome_max = 0;
+	switch (outcome)
+	{
+		case LookupFound:
+			lifetime = config.m_found_ttl;
+			outcome_max = config.m_found_max_ttl;
+			break;
+		case LookupNotFound:
+			lifetime = config.m_notfound_ttl;
+			outcome_max = config.m_notfound_max_ttl;
+			break;
+		case LookupError:
+			lifetime = config.m_error_ttl;
+			outcome_max = config.m_error_max_ttl;
+			break;
+		case LookupTimedOut:
+			lifetime = config.m_timeout_ttl;
+			outcome_max = config.m_timeout_max_ttl;
+			break;
+	}
+	if (outcome_max < max_lifetime)
+	{
+		max_lifetime = outcome_max;
+	}
+	if (lifetime > max_lifetime)
+	{
+		lifetime = max_lifetime;
+	}
+
+	insert(CacheEntry::makeKey(redirector, filename), outcome, hosts, now, lifetime, max_lifetime, complete);
 }
 
-classad_shared_ptr<ExprList>
-ResponseCache::getList(const std::set<std::string> &hosts)
+void
+ResponseCache::insert(const std::string &key, LookupOutcome outcome, const HostSet & hosts,
+	time_t now, unsigned int lifetime, unsigned int max_lifetime, bool complete)
 {
+	// The ExprLists and the trie count against the ceiling too, up to
+	// their shares; the entries get the rest.
+	size_t ceiling = Config::getInstance().m_cache_bytes;
+	AtomicBeg(m_atomic_mutex);
+	size_t table_bytes = AtomicGet(m_table_bytes);
+	AtomicEnd(m_atomic_mutex);
+	table_bytes = std::min(table_bytes, ceiling / 100 * m_table_percent);
+	size_t trie_bytes = std::min(m_prefixes.bytes(), ceiling / 100 * m_trie_percent);
+	size_t budget = (ceiling - table_bytes - trie_bytes) / m_shard_count;
 
-	ExprList *expr_list_ptr = new ExprList();
-	for (std::set<std::string>::const_iterator it = hosts.begin(); it != hosts.end(); ++it)
+	if (complete && outcome == LookupFound && !hosts.empty())
 	{
-		Value v;
-		v.SetStringValue(*it);
-		expr_list_ptr->push_back(Literal::MakeLiteral(v));
+		// The key's redirector prefix becomes the trie's top level.
+		m_prefixes.learn(key, hosts, now, now + lifetime, ceiling / 100 * m_trie_percent);
 	}
 
-	classad_shared_ptr<ExprList> expr_list;
-	expr_list.reset(expr_list_ptr);
-	return expr_list;
+	Stats::getInstance().inc(StatCacheInserts);
+
+	CacheShard &shard = getShard(key);
+	CountingRWLockHelper monitor(shard.m_lock, false);
+	if (shard.insert(key, outcome, hosts, now, lifetime, max_lifetime, budget))
+		touch(shard);
 }
 
 void
-ResponseCache::addToList(const std::set<std::string> &hosts, classad_shared_ptr<ExprList> expr_list)
+ResponseCache::touch(CacheShard &shard)
 {
-	for (std::set<std::string>::const_iterator it = hosts.begin(); it != hosts.end(); ++it)
+	AtomicBeg(m_atomic_mutex);
+	uint64_t stamp = AtomicInc(m_stamp) + 1;
+	AtomicEnd(m_atomic_mutex);
+	shard.m_stamp = stamp;
+}
+
+uint64_t
+ResponseCache::getStamp()
+{
+	AtomicBeg(m_atomic_mutex);
+	uint64_t stamp = AtomicGet(m_stamp);
+	AtomicEnd(m_atomic_mutex);
+	return stamp;
+}
+
+bool
+ResponseCache::unchangedSince(const CacheFootprint &footprint, uint64_t stamp)
+{
+	for (uint64_t shards = footprint.m_shards; shards; shards &= shards - 1)
+	{
+		CacheShard &shard = m_shards[__builtin_ctzll(shards)];
+		AtomicBeg(m_atomic_mutex);
+		uint64_t shard_stamp = AtomicGet(shard.m_stamp);
+		AtomicEnd(m_atomic_mutex);
+		if (shard_stamp > stamp)
+			return false;
+	}
+	return true;
+}
+
+classad_shared_ptr<ExprList>
+ResponseCache::getList(const HostSet &hosts)
+{
+	// The low bits pick the bucket within a shard; use the high ones here.
+	size_t hash = HostSetHash()(hosts);
+	ListShard &shard = m_list_shards[(hash >> 16) % m_list_shard_count];
+	{
+		XrdSysRWLockHelper monitor(shard.m_lock, true);
+		ResponseTable::const_iterator it = shard.m_table.find(hosts);
+		if (it != shard.m_table.end())
+			return it->second;
+	}
+
+	// Build the list outside the lock; if we race with another thread,
+	// the first list inserted wins.
+	classad_shared_ptr<ExprList> expr_list;
+	expr_list.reset(new ExprList());
+	std::vector<std::string> names;
+	hosts.getNames(names);
+	size_t bytes = sizeof(ExprList) + sizeof(ResponseTable::value_type) + hosts.getWords().capacity()*sizeof(uint64_t);
+	for (std::vector<std::string>::const_iterator it = names.begin(); it != names.end(); ++it)
 	{
 		Value v;
 		v.SetStringValue(*it);
 		expr_list->push_back(Literal::MakeLiteral(v));
+		bytes += sizeof(Literal) + sizeof(void*) + it->capacity();
+	}
+
+	XrdSysRWLockHelper monitor(shard.m_lock, false);
+	if (shard.m_bytes + bytes > Config::getInstance().m_cache_bytes / 100 * m_table_percent / m_list_shard_count)
+	{
+		// Start over rather than track recency on every hit; the lists
+		// still popular are rebuilt on their next use.
+		shard.m_table.clear();
+		AtomicBeg(m_atomic_mutex);
+		AtomicSub(m_table_bytes, shard.m_bytes);
+		AtomicEnd(m_atomic_mutex);
+		shard.m_bytes = 0;
+	}
+	std::pair<ResponseTable::iterator, bool> result = shard.m_table.insert(std::make_pair(hosts, expr_list));
+	if (result.second)
+	{
+		shard.m_bytes += bytes;
+		AtomicBeg(m_atomic_mutex);
+		AtomicAdd(m_table_bytes, bytes);
+		AtomicEnd(m_atomic_mutex);
 	}
+	return result.first->second;
 }
 
+void
+ResponseCache::getUsage(size_t &entries, size_t &entry_bytes, size_t &table_bytes)
+{
+	entries = 0;
+	entry_bytes = 0;
+	for (unsigned int idx = 0; idx < m_shard_count; idx++)
+	{
+		XrdSysRWLockHelper monitor(m_shards[idx].m_lock, true);
+		entries += m_shards[idx].size();
+		entry_bytes += m_shards[idx].bytes();
+	}
+	entry_bytes += m_prefixes.bytes();
+
+	AtomicBeg(m_atomic_mutex);
+	table_bytes = AtomicGet(m_table_bytes);
+	AtomicEnd(m_atomic_mutex);
+}
@@ -1,11 +1,18 @@
 #ifndef __RESPONSECACHE_H_
 #define __RESPONSECACHE_H_
 
+#include <set>
 #include <string>
+#include <vector>
 #include "XrdSys/XrdSysPthread.hh"
+#include "XrdSys/XrdSysAtomics.hh"
 
 #include "classad/classad_distribution.h"
 
+#include "host_table.h"
+#include "key_arena.h"
+#include "prefix_trie.h"
+
 namespace ClassadXrootdMapping {
 
 /*
@@ -13,69 +20,376 @@ namespace ClassadXrootdMapping {
  */
 
 class CacheEntry;
+class CacheShard;
+class EvictionQueue;
+class MappedSnapshot;
 class ResponseCache;
+struct SnapshotItem;
+
+/*
+ * How a lookup ended; each outcome is cached for its own lifetime.
+ */
+enum LookupOutcome {
+	LookupFound,
+	LookupNotFound,
+	LookupError,
+	LookupTimedOut
+};
+
+/*
+ * Which cached answers a query() used, so a result built from them can be
+ * reused until one of them expires or changes.
+ */
+struct CacheFootprint {
+	CacheFootprint() : m_shards(0), m_expiration(0), m_complete(true) {}
+
+	uint64_t m_shards;   // A bit for each shard holding one of the answers.
+	time_t m_expiration; // When the first of them expires; 0 if none was used.
+	bool m_complete;     // False if any file had no valid answer.
+};
+
+struct HostSetHash {
+	size_t operator()(const HostSet &hosts) const;
+};
 
-typedef classad_unordered<std::string, CacheEntry*> ResponseMap;
 /*
- * ClassAds leaks the ExprList object for functions returning lists.
- * Hence, we get to stand on our head to cache all the prior responses.
- * That way, it's memory hoarding, not memory leaks.
+ * The ExprLists returned for host sets seen before, so that popular answers
+ * are built once.  Lists are never modified once built, and results share
+ * ownership of them, so a list outlives the table's reference if needed.
+ * The table is emptied whenever it outgrows its share of the memory
+ * ceiling.
  */
-typedef classad_unordered<std::string, classad_shared_ptr<classad::ExprList> > ResponseTable;
+typedef classad_unordered<HostSet, classad_shared_ptr<classad::ExprList>, HostSetHash> ResponseTable;
+
+/*
+ * One slice of the lists, chosen by the host set's hash, so evaluations
+ * building or fetching lists for different answers rarely share a lock.
+ * Each slice is emptied on its own when it outgrows its part of the
+ * lists' share.
+ */
+struct ListShard {
+	ListShard() : m_bytes(0) {}
+
+	ResponseTable m_table;
+	size_t m_bytes; // Approximate memory held by m_table.
+	XrdSysRWLock m_lock; // Protects m_table and m_bytes.
+};
 
 class CacheEntry {
 
-friend class ResponseCache;
+friend class CacheShard;
+friend class ExpiryWheel;
+friend class EvictionQueue;
+friend class ResponseIndex;
 
 public:
 
-	const std::set<std::string> &getSet() const;
+	const HostSet &getSet() const;
+
+	LookupOutcome getOutcome() const { return m_outcome; }
+
+	time_t getExpiration() const { return m_expiration; }
 
 	bool isValid(time_t) const;
 
-	static std::string createHash(const std::set<std::string> & hosts);
+	// Past its lifetime, but still good enough to answer while it is refreshed.
+	bool isStale(time_t) const;
+
+	static size_t createHash(const HostSet & hosts);
+
+	// Cache keys are the redirector's ID, in hex, then ':' and the filename,
+	// so answers from different federations never mix.
+	static std::string makeKey(RedirectorId redirector, const std::string &filename);
+	// Reuses the storage of `key`.
+	static void makeKey(RedirectorId redirector, const std::string &filename, std::string &key);
+	static bool splitKey(const std::string &key, RedirectorId &redirector, std::string &filename);
 
 protected:
 
-	CacheEntry(const std::string &, const std::set<std::string> &, time_t, ResponseCache &);
+	CacheEntry(PrefixHandle, uint32_t, LookupOutcome, const HostSet &);
 
 private:
 
-	std::string m_filename;
+	// The key is the prefix, in the shard's arena, then the basename,
+	// stored past the end of the entry.
+	static CacheEntry *create(PrefixHandle prefix, uint32_t hash, const char *name, size_t length,
+		LookupOutcome outcome, const HostSet &hosts);
+	static void destroy(CacheEntry *);
+
+	bool matches(const char *key, size_t length, const PrefixArena &prefixes) const;
+	void getKey(const PrefixArena &prefixes, std::string &key) const;
+
+	// Approximate heap footprint, including the entry's index slot.
+	size_t memoryUsage() const;
+
+	PrefixHandle m_prefix;
+	uint32_t m_hash; // hashKey() of the whole key.
+	uint32_t m_name_length;
 	time_t m_expiration;
-	std::set<std::string> m_set;
+	time_t m_stale_until; // End of the grace period; the entry is reaped then.
+	HostSet m_set;
+	LookupOutcome m_outcome;
+	unsigned int m_streak; // Consecutive lookups that ended with m_outcome.
+
+	// Set by readers on a hit; cleared by the eviction scan.
+	mutable int m_referenced;
+
+	// Set by the first reader to find the entry stale; cleared when the
+	// answer is replaced.
+	mutable int m_refreshing;
+
+	// Links in the shard's expiry wheel slot.
+	CacheEntry *m_wheel_prev;
+	CacheEntry *m_wheel_next;
+
+	// Links in the shard's eviction queue.
+	CacheEntry *m_queue_prev;
+	CacheEntry *m_queue_next;
+	EvictionQueue *m_queue;
+
+	// Must be last; create() allocates room for the whole basename.
+	char m_name[1];
+};
+
+/*
+ * A shard's entries, hashed by key.  Open addressing over the entries
+ * themselves: keys are compared in place against each entry's prefix and
+ * basename, so a lookup needs no std::string, and no entry keeps a copy
+ * of its key for the index.
+ */
+class ResponseIndex {
+
+public:
+
+	ResponseIndex() : m_size(0) {}
+
+	CacheEntry *find(const char *key, size_t length, uint32_t hash, const PrefixArena &prefixes) const;
+
+	// The entry's key must not be in the index yet.
+	void insert(CacheEntry *);
+	void erase(CacheEntry *);
+
+	size_t size() const { return m_size; }
+
+	// Every slot, empty ones NULL; for walking all the entries.
+	const std::vector<CacheEntry *> &slots() const { return m_slots; }
+
+private:
+
+	void grow();
+
+	std::vector<CacheEntry *> m_slots;
+	size_t m_size;
+};
+
+/*
+ * Hashed timer wheel with one-second slots.  Entries are threaded onto the
+ * slot for the second their grace period ends, so reaping a second only visits the
+ * entries due then (plus any due a full revolution later, which are skipped).
+ */
+class ExpiryWheel {
+
+public:
+
+	ExpiryWheel();
+
+	void add(CacheEntry *);
+	void remove(CacheEntry *);
+
+	// Collects the entries of the given second's slot that are past their grace period at `now`.
+	void expire(time_t second, time_t now, std::vector<CacheEntry*> &expired);
 
+	static const unsigned int m_slot_count = 1024;
+
+private:
+
+	CacheEntry *m_slots[m_slot_count];
+};
+
+/*
+ * Intrusive FIFO of cache entries, tracking the bytes it holds.
+ */
+class EvictionQueue {
+
+public:
+
+	EvictionQueue() : m_head(NULL), m_tail(NULL), m_bytes(0) {}
+
+	void push_back(CacheEntry *);
+	void remove(CacheEntry *);
+
+	CacheEntry *front() const { return m_head; }
+	size_t bytes() const { return m_bytes; }
+
+private:
+
+	CacheEntry *m_head;
+	CacheEntry *m_tail;
+	size_t m_bytes;
+};
+
+/*
+ * One slice of the cache.  Lookups only take the shard's lock for reading,
+ * so cache hits on different threads do not serialize.
+ *
+ * Eviction is a two-queue CLOCK: new entries wait in a small probationary
+ * FIFO and are only promoted to the main CLOCK queue if they were hit while
+ * there.  A flood of one-off lookups thus cycles through probation without
+ * pushing out the hot files.  Hits only set a flag, so they need no write lock.
+ */
+class CacheShard {
+
+public:
+
+	CacheShard() : m_stamp(0), m_bytes(0) {}
+
+	const CacheEntry *find(const char *key, size_t length) const;
+
+	// True for only the first caller to find the entry stale.
+	bool claimRefresh(const CacheEntry *entry) const;
+	// Lets the next caller claim it again, if the refresh was never sent.
+	void releaseRefresh(const CacheEntry *entry) const;
+
+	// The lifetime starts at `lifetime` and doubles for each repeat of the outcome.
+	// Found answers are then kept for the stale grace period.  Returns true
+	// if an existing answer was replaced by a different one, or any was
+	// evicted to make room.
+	bool insert(const std::string &key, LookupOutcome outcome, const HostSet &hosts,
+		time_t now, unsigned int lifetime, unsigned int max_lifetime, size_t budget);
+
+	// Returns true if any entry was reaped.
+	bool expire(time_t second, time_t now);
+
+	// Copies out the entries still valid at `now`.
+	void collect(time_t now, std::vector<SnapshotItem> &items) const;
+
+	size_t size() const { return m_index.size(); }
+	size_t bytes() const { return m_bytes + m_prefixes.bytes(); }
+
+	XrdSysRWLock m_lock;
+
+	// The cache's change stamp when an answer here was last replaced or removed.
+	uint64_t m_stamp;
+
+private:
+
+	// Returns the number of entries evicted.
+	size_t evict(size_t budget);
+	void erase(CacheEntry *);
+
+	// Share of the shard budget reserved for probation.
+	static const unsigned int m_probation_percent = 10;
+
+	ResponseIndex m_index;
+	PrefixArena m_prefixes;
+	ExpiryWheel m_wheel;
+	EvictionQueue m_probation;
+	EvictionQueue m_main;
+	size_t m_bytes;
+
+	mutable XrdSysMutex m_atomic_mutex; // Only used where there are no atomics.
 };
 
 class ResponseCache {
 
 public:
 
-	classad_shared_ptr<classad::ExprList> query(std::vector<std::string> &filename, std::vector<std::string> & files_to_query);
+	// Stale answers are used as they are; the files that need a background
+	// refresh are added to files_to_refresh, each only once per expiry.
+	// With file_hosts, sized like filename, each file's answer is also
+	// merged into its slot there.
+	void query(RedirectorId redirector, std::vector<std::string> &filename, HostSet & hosts,
+		std::vector<std::string> & files_to_query, std::vector<std::string> & files_to_refresh,
+		CacheFootprint *footprint = NULL, std::vector<HostSet> *file_hosts = NULL);
+
+	// Changes whenever a cached answer is replaced by a different one or removed.
+	uint64_t getStamp();
+
+	// True if no answer in the footprint's shards has been replaced or removed since `stamp`.
+	bool unchangedSince(const CacheFootprint &footprint, uint64_t stamp);
+
+	// Provisional answers for misses, taken from other files in the same
+	// directory.  Files answered this way move to files_guessed.  With
+	// file_hosts, sized like files_to_query, each guess is also merged
+	// into the file's slot there.
+	void guess(RedirectorId redirector, std::vector<std::string> &files_to_query, HostSet & hosts,
+		std::vector<std::string> & files_guessed, std::vector<HostSet> *file_hosts = NULL);
+
+	// Gives up the refreshes claimed by query() or needsLookup() for files
+	// whose lookups could not be sent, so a later lookup tries again.
+	void abandonRefresh(RedirectorId redirector, const std::vector<std::string> &filenames);
 
-	void insert(const std::string &filename, const std::set<std::string> & hosts);
+	// For prefetches: true if the file has no answer, or if its answer is
+	// stale and this caller claimed the refresh.  Counts no hits or misses.
+	bool needsLookup(RedirectorId redirector, const std::string &filename);
+
+	void insert(RedirectorId redirector, const std::string &filename, LookupOutcome outcome, const HostSet & hosts);
+	// Caps the lifetime, e.g. for answers that are still incomplete.
+	void insert(RedirectorId redirector, const std::string &filename, LookupOutcome outcome, const HostSet & hosts,
+		unsigned int max_lifetime);
 
 	static ResponseCache &getInstance();
 
-	static classad_shared_ptr<classad::ExprList> getList(const std::set<std::string> &hosts);
-	static void addToList(const std::set<std::string> &hosts, classad_shared_ptr<classad::ExprList>);
+	// The returned list is shared and must not be modified.
+	classad_shared_ptr<classad::ExprList> getList(const HostSet &hosts);
+
+	// Number of entries, and the approximate memory held by them (with the
+	// trie learned from them) and by the lists.
+	void getUsage(size_t &entries, size_t &entry_bytes, size_t &table_bytes);
 
 private:
 
 	ResponseCache();
 
-	void prune(time_t);
+	void reapLoop();
+	static void *reaperThread(void *);
 
-	static const unsigned int m_lifetime_seconds; // The lifetime of each cache entry.
-	time_t m_last_pruning;
+	void snapshotLoop();
+	static void *snapshotThread(void *);
 
-	ResponseMap m_response_map; // Cache with limited lifetime of entries
-	ResponseTable m_response_table; // Permanent table of all ExprLists.
+	void restore(RedirectorId redirector, std::vector<std::string> &filenames, size_t first, HostSet &hosts, time_t now,
+		std::vector<HostSet> *file_hosts = NULL);
+	// Only complete answers teach the trie about their directory.
+	void insert(RedirectorId redirector, const std::string &filename, LookupOutcome outcome, const HostSet & hosts,
+		unsigned int max_lifetime, bool complete);
+	void insert(const std::string &key, LookupOutcome outcome, const HostSet & hosts, time_t now, unsigned int lifetime,
+		unsigned int max_lifetime, bool complete);
 
-	static ResponseCache * m_instance;
-	static XrdSysMutex m_instance_mutex;
+	CacheShard &getShard(const std::string &key);
+
+	// Marks the shard as changed, for unchangedSince().  Must be called with
+	// the shard locked for writing.
+	void touch(CacheShard &shard);
+
+	static void createInstance();
+
+	static const unsigned int m_shard_count = 64; // One bit each in CacheFootprint::m_shards.
+	static const unsigned int m_list_shard_count = 16;
+
+	CacheShard m_shards[m_shard_count]; // Cache with limited lifetime of entries
+	ListShard m_list_shards[m_list_shard_count]; // Permanent table of all ExprLists.
+	PrefixTrie m_prefixes; // Replica sets learned per directory.
 
-	XrdSysMutex m_table_mutex;
+	// Approximate memory held by all the list shards; updated atomically,
+	// so inserts can size their budget without taking any list lock.
+	size_t m_table_bytes;
+
+	// Shares of the memory ceiling, in percent, the lists and the trie may
+	// use; the entries always get the rest.
+	static const unsigned int m_table_percent = 25;
+	static const unsigned int m_trie_percent = 10;
+
+	static const time_t m_trie_reap_interval = 60; // Seconds between walks of the trie.
+
+	uint64_t m_stamp; // Bumped each time an answer is replaced or removed.
+	XrdSysMutex m_atomic_mutex; // Only used where there are no atomics.
+
+	// The snapshot found at startup; misses are looked up there until it expires.
+	MappedSnapshot *m_snapshot;
+	XrdSysRWLock m_snapshot_lock;
+
+	static ResponseCache * m_instance;
+	static pthread_once_t m_instance_once;
 };
 
 }
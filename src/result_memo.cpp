@@ -0,0 +1,117 @@
+
+#include <cstring>
+#include <time.h>
+
+#include "result_memo.h"
+#include "config.h"
+#include "stats.h"
+
+using namespace classad;
+using namespace ClassadXrootdMapping;
+
+ResultMemo * ResultMemo::m_instance = NULL;
+pthread_once_t ResultMemo::m_instance_once = PTHREAD_ONCE_INIT;
+
+void
+MemoKey::mix(uint64_t word)
+{
+	// FNV-1a over whole words, and FxHash's rotate, xor and multiply.
+	m_low = (m_low ^ word) * 1099511628211ULL;
+	m_high = ((m_high << 5 | m_high >> 59) ^ word) * 0x517cc1b727220a95ULL;
+}
+
+void
+MemoKey::add(const char *data, size_t length)
+{
+	mix(length);
+	while (length >= sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, data, sizeof(word));
+		mix(word);
+		data += sizeof(word);
+		length -= sizeof(word);
+	}
+	if (length)
+	{
+		uint64_t word = 0;
+		memcpy(&word, data, length);
+		mix(word);
+	}
+}
+
+void
+MemoKey::finish()
+{
+	// Word-at-a-time FNV leaves the low bits, which pick the slot, weak;
+	// finish with MurmurHash3's mixer.
+	m_low ^= m_low >> 33;
+	m_low *= 0xff51afd7ed558ccdULL;
+	m_low ^= m_low >> 33;
+	m_low *= 0xc4ceb9fe1a85ec53ULL;
+	m_low ^= m_low >> 33;
+}
+
+ResultMemo::ResultMemo()
+{
+	m_entries.resize(Config::getInstance().m_memo_entries);
+}
+
+void
+ResultMemo::createInstance()
+{
+	m_instance = new ResultMemo();
+}
+
+ResultMemo &
+ResultMemo::getInstance()
+{
+	pthread_once(&m_instance_once, createInstance);
+	return *m_instance;
+}
+
+bool
+ResultMemo::find(const MemoKey &key, classad_shared_ptr<ExprList> &list)
+{
+	if (m_entries.empty())
+		return false;
+
+	size_t idx = key.m_low % m_entries.size();
+	uint64_t stamp;
+	CacheFootprint footprint;
+	{
+		XrdSysMutexHelper lock(m_locks[idx % m_lock_count]);
+		const MemoEntry &entry = m_entries[idx];
+		if (!entry.m_list || !(entry.m_key == key))
+			return false;
+		stamp = entry.m_stamp;
+		footprint = entry.m_footprint;
+		list = entry.m_list;
+	}
+
+	// Answers only from the catalog never expire.
+	if ((footprint.m_expiration && footprint.m_expiration <= time(NULL)) ||
+		!ResponseCache::getInstance().unchangedSince(footprint, stamp))
+	{
+		list.reset();
+		return false;
+	}
+	Stats::getInstance().inc(StatMemoHits);
+	return true;
+}
+
+void
+ResultMemo::insert(const MemoKey &key, uint64_t stamp, const CacheFootprint &footprint,
+	const classad_shared_ptr<ExprList> &list)
+{
+	if (m_entries.empty() || !footprint.m_complete)
+		return;
+
+	size_t idx = key.m_low % m_entries.size();
+	XrdSysMutexHelper lock(m_locks[idx % m_lock_count]);
+	MemoEntry &entry = m_entries[idx];
+	entry.m_key = key;
+	entry.m_stamp = stamp;
+	entry.m_footprint = footprint;
+	entry.m_list = list;
+}
@@ -0,0 +1,93 @@
+#ifndef __RESULTMEMO_H_
+#define __RESULTMEMO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+#include "XrdSys/XrdSysPthread.hh"
+
+#include "classad/classad_distribution.h"
+
+#include "response_cache.h"
+
+namespace ClassadXrootdMapping {
+
+/*
+ * 128-bit hash of a call's arguments, fed one string at a time.  Two
+ * unrelated 64-bit hashes of the same words, so a collision would need
+ * both to collide at once.
+ */
+class MemoKey {
+
+public:
+
+	MemoKey() : m_low(14695981039346656037ULL), m_high(0) {}
+
+	void add(const char *data, size_t length);
+
+	// Ends an argument, so ("a", "b") and ("ab") hash apart.
+	void separate() { mix(0xff); }
+
+	// Call once all the arguments are in.
+	void finish();
+
+	bool operator==(const MemoKey &other) const { return m_low == other.m_low && m_high == other.m_high; }
+
+	uint64_t m_low;
+	uint64_t m_high;
+
+private:
+
+	void mix(uint64_t word);
+};
+
+/*
+ * Whole-call memo for files_to_sites: the final list for a redirector and
+ * an ordered file list, by the hash of both.  An entry is only used while
+ * every cached answer behind it is valid and unchanged, so a repeated call
+ * costs one hash and one lookup instead of one per file.
+ *
+ * The table is direct-mapped; a new result simply replaces whatever was in
+ * its slot.
+ */
+class ResultMemo {
+
+public:
+
+	static ResultMemo &getInstance();
+
+	bool enabled() const { return !m_entries.empty(); }
+
+	bool find(const MemoKey &key, classad_shared_ptr<classad::ExprList> &list);
+
+	// `stamp` is the cache's change stamp from before the query that
+	// produced `footprint`.
+	void insert(const MemoKey &key, uint64_t stamp, const CacheFootprint &footprint,
+		const classad_shared_ptr<classad::ExprList> &list);
+
+private:
+
+	ResultMemo();
+
+	static void createInstance();
+
+	struct MemoEntry {
+		MemoKey m_key;
+		uint64_t m_stamp;
+		CacheFootprint m_footprint;
+		classad_shared_ptr<classad::ExprList> m_list; // Owned by the cache's response table.
+	};
+
+	static const unsigned int m_lock_count = 64;
+
+	std::vector<MemoEntry> m_entries;
+	XrdSysMutex m_locks[m_lock_count]; // Each protects every m_lock_count'th entry.
+
+	static ResultMemo * m_instance;
+	static pthread_once_t m_instance_once;
+};
+
+}
+
+#endif
@@ -0,0 +1,137 @@
+
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "host_table.h"
+#include "response_cache.h"
+#include "result_memo.h"
+#include "test_utils.h"
+#include "time_utils.h"
+
+using namespace ClassadXrootdMapping;
+
+static const RedirectorId redirector = 1;
+
+static HostSet make_hosts(const std::string &hostname)
+{
+	HostId id;
+	HostSet hosts;
+	if (HostTable::getInstance().intern(hostname, id))
+		hosts.insert(id);
+	return hosts;
+}
+
+static MemoKey make_key(const std::string &filename)
+{
+	MemoKey key;
+	key.add(filename.data(), filename.size());
+	key.separate();
+	key.finish();
+	return key;
+}
+
+/*
+ * Queries the cache for one file and remembers the result as
+ * files_to_sites would; false if the answer was not cached.
+ */
+static bool memoize(const std::string &filename)
+{
+	ResponseCache &cache = ResponseCache::getInstance();
+	uint64_t stamp = cache.getStamp();
+	CacheFootprint footprint;
+	std::vector<std::string> filenames(1, filename);
+	std::vector<std::string> files_to_query, files_to_refresh;
+	HostSet hosts;
+	cache.query(redirector, filenames, hosts, files_to_query, files_to_refresh, &footprint);
+	if (!files_to_query.empty())
+		return false;
+	ResultMemo::getInstance().insert(make_key(filename), stamp, footprint, cache.getList(hosts));
+	return true;
+}
+
+static bool remembered(const std::string &filename)
+{
+	classad_shared_ptr<classad::ExprList> list;
+	return ResultMemo::getInstance().find(make_key(filename), list) && list;
+}
+
+// A file whose answer lands in a different shard than the given file's.
+static std::string other_shard(const std::string &filename)
+{
+	ResponseCache &cache = ResponseCache::getInstance();
+	std::vector<std::string> files_to_query, files_to_refresh;
+	HostSet hosts;
+	CacheFootprint footprint;
+	std::vector<std::string> filenames(1, filename);
+	cache.query(redirector, filenames, hosts, files_to_query, files_to_refresh, &footprint);
+
+	for (unsigned int idx = 0; ; idx++)
+	{
+		std::stringstream other;
+		other << "/store/other/file" << idx << ".root";
+		cache.insert(redirector, other.str(), LookupFound, make_hosts("site1.example.org"));
+		CacheFootprint other_footprint;
+		filenames.assign(1, other.str());
+		cache.query(redirector, filenames, hosts, files_to_query, files_to_refresh, &other_footprint);
+		if (!(other_footprint.m_shards & footprint.m_shards))
+			return other.str();
+	}
+}
+
+/*
+ * A remembered result is used until an answer in one of its shards is
+ * replaced; changes elsewhere in the cache leave it alone.
+ */
+static void test_stamp()
+{
+	ResponseCache &cache = ResponseCache::getInstance();
+	const std::string filename = "/store/memo/file0.root";
+	cache.insert(redirector, filename, LookupFound, make_hosts("site0.example.org"));
+	std::string unrelated = other_shard(filename);
+
+	check(!remembered(filename), "nothing remembered yet");
+	check(memoize(filename), "answer cached");
+	check(remembered(filename), "remembered result found");
+
+	cache.insert(redirector, unrelated, LookupFound, make_hosts("site2.example.org"));
+	check(remembered(filename), "kept across a change in another shard");
+
+	cache.insert(redirector, filename, LookupFound, make_hosts("site3.example.org"));
+	check(!remembered(filename), "dropped when its answer changes");
+
+	check(memoize(filename), "answer cached again");
+	check(remembered(filename), "new result found");
+}
+
+/*
+ * A remembered result is dropped once the earliest answer behind it has
+ * expired, even though nothing in the cache changed.
+ */
+static void test_expiration()
+{
+	ResponseCache &cache = ResponseCache::getInstance();
+	const std::string filename = "/store/memo/expiring.root";
+	cache.insert(redirector, filename, LookupFound, make_hosts("site0.example.org"));
+	check(memoize(filename), "answer cached");
+	check(remembered(filename), "remembered result found");
+
+	uint64_t stamp = cache.getStamp();
+	sleep_us(3100000);
+	checkEqual(cache.getStamp(), stamp, "stamp after waiting");
+	check(!remembered(filename), "dropped once its answer expired");
+}
+
+int main() {
+
+	// Answers expire after two seconds, and are then kept as stale, so
+	// the expiry alone changes nothing in the cache.
+	setenv("CLASSAD_XROOTD_FOUND_TTL", "2", 1);
+	setenv("CLASSAD_XROOTD_FOUND_MAX_TTL", "2", 1);
+
+	test_stamp();
+	test_expiration();
+
+	return finishTests("result memo");
+}
@@ -0,0 +1,213 @@
+
+#include <cstdio>
+#include <unistd.h>
+
+#include "XrdSys/XrdSysAtomics.hh"
+#include "XrdSys/XrdSysTimer.hh"
+
+#include "stats.h"
+#include "config.h"
+#include "response_cache.h"
+#include "xrootd_client.h"
+
+using namespace ClassadXrootdMapping;
+
+Stats * Stats::m_instance = NULL;
+pthread_once_t Stats::m_instance_once = PTHREAD_ONCE_INIT;
+
+static const char *counter_names[StatCounterCount] = {
+	"Calls",
+	"CallErrors",
+	"MemoHits",
+	"CacheHits",
+	"CacheStaleHits",
+	"CacheMisses",
+	"SnapshotHits",
+	"CatalogHits",
+	"Guesses",
+	"CacheInserts",
+	"CacheEvictions",
+	"CacheExpirations",
+	"LockContention",
+	"Locates",
+	"LocateBatches",
+	"LocatesJoined",
+	"DeepLocates",
+	"ManagerCacheHits",
+	"LocateSendFailures",
+	"LocateFound",
+	"LocateNotFound",
+	"LocateErrors",
+	"LocateTimeouts",
+	"MapMisses",
+	"Hedges",
+	"BreakerOpens",
+	"BreakerRejects",
+	"DnsLookups",
+	"DnsFailures"
+};
+
+static const char *histogram_names[StatHistogramCount] = {
+	"CallLatency",
+	"LocateLatency",
+	"DnsLatency"
+};
+
+Stats::Stats()
+{
+	for (unsigned int idx = 0; idx < StatCounterCount; idx++)
+	{
+		m_counters[idx] = 0;
+	}
+	for (unsigned int idx = 0; idx < StatHistogramCount; idx++)
+	{
+		for (unsigned int bucket = 0; bucket < m_bucket_count; bucket++)
+		{
+			m_buckets[idx][bucket] = 0;
+		}
+	}
+
+	if (!Config::getInstance().m_stats_path.empty())
+	{
+		pthread_t tid;
+		XrdSysThread::Run(&tid, dumpThread, this, 0, "Statistics dump");
+	}
+}
+
+void
+Stats::createInstance()
+{
+	m_instance = new Stats();
+}
+
+Stats &
+Stats::getInstance()
+{
+	pthread_once(&m_instance_once, createInstance);
+	return *m_instance;
+}
+
+void
+Stats::inc(StatCounter counter, unsigned long long count)
+{
+	AtomicBeg(m_atomic_mutex);
+	AtomicAdd(m_counters[counter], count);
+	AtomicEnd(m_atomic_mutex);
+}
+
+void
+Stats::record(StatHistogram histogram, uint64_t latency_us)
+{
+	unsigned int bucket = 0;
+	while (bucket < m_bucket_count - 1 && (static_cast<uint64_t>(1) << bucket) <= latency_us)
+	{
+		bucket++;
+	}
+	AtomicBeg(m_atomic_mutex);
+	AtomicInc(m_buckets[histogram][bucket]);
+	AtomicEnd(m_atomic_mutex);
+}
+
+/*
+ * The upper bound of the bucket holding the given permille of the samples.
+ */
+uint64_t
+Stats::percentile(const unsigned long long *buckets, unsigned long long count, unsigned int permille) const
+{
+	if (!count)
+		return 0;
+	unsigned long long rank = (count * permille + 999) / 1000;
+	unsigned long long seen = 0;
+	for (unsigned int bucket = 0; bucket < m_bucket_count; bucket++)
+	{
+		seen += buckets[bucket];
+		if (seen >= rank)
+			return static_cast<uint64_t>(1) << bucket;
+	}
+	return static_cast<uint64_t>(1) << (m_bucket_count - 1);
+}
+
+void
+Stats::collect(std::vector<std::pair<std::string, long long> > &values)
+{
+	for (unsigned int idx = 0; idx < StatCounterCount; idx++)
+	{
+		unsigned long long value;
+		AtomicBeg(m_atomic_mutex);
+		value = AtomicGet(m_counters[idx]);
+		AtomicEnd(m_atomic_mutex);
+		values.push_back(std::make_pair(std::string(counter_names[idx]), static_cast<long long>(value)));
+	}
+
+	for (unsigned int idx = 0; idx < StatHistogramCount; idx++)
+	{
+		unsigned long long buckets[m_bucket_count];
+		unsigned long long count = 0;
+		AtomicBeg(m_atomic_mutex);
+		for (unsigned int bucket = 0; bucket < m_bucket_count; bucket++)
+		{
+			buckets[bucket] = AtomicGet(m_buckets[idx][bucket]);
+			count += buckets[bucket];
+		}
+		AtomicEnd(m_atomic_mutex);
+
+		std::string name = histogram_names[idx];
+		values.push_back(std::make_pair(name + "Count", static_cast<long long>(count)));
+		values.push_back(std::make_pair(name + "P50", static_cast<long long>(percentile(buckets, count, 500))));
+		values.push_back(std::make_pair(name + "P99", static_cast<long long>(percentile(buckets, count, 990))));
+		values.push_back(std::make_pair(name + "P999", static_cast<long long>(percentile(buckets, count, 999))));
+	}
+
+	size_t entries, entry_bytes, table_bytes;
+	ResponseCache::getInstance().getUsage(entries, entry_bytes, table_bytes);
+	values.push_back(std::make_pair(std::string("CacheEntries"), static_cast<long long>(entries)));
+	values.push_back(std::make_pair(std::string("CacheBytes"), static_cast<long long>(entry_bytes + table_bytes)));
+	values.push_back(std::make_pair(std::string("Clients"), static_cast<long long>(FileMappingClient::getClientCount())));
+}
+
+bool
+Stats::dump(const std::string &path)
+{
+	std::vector<std::pair<std::string, long long> > values;
+	collect(values);
+
+	// Write aside and rename, so readers never see a partial file.
+	char pid[32];
+	snprintf(pid, sizeof(pid), ".%d", static_cast<int>(getpid()));
+	std::string tmp_path = path + ".tmp" + pid;
+	FILE *fp = fopen(tmp_path.c_str(), "w");
+	if (!fp)
+		return false;
+
+	bool ok = true;
+	for (std::vector<std::pair<std::string, long long> >::const_iterator it = values.begin(); it != values.end(); ++it)
+	{
+		ok = ok && fprintf(fp, "%s = %lld\n", it->first.c_str(), it->second) > 0;
+	}
+	ok = (fclose(fp) == 0) && ok;
+
+	if (!ok || rename(tmp_path.c_str(), path.c_str()))
+	{
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+void *
+Stats::dumpThread(void *arg)
+{
+	static_cast<Stats*>(arg)->dumpLoop();
+	return NULL;
+}
+
+void
+Stats::dumpLoop()
+{
+	const Config &config = Config::getInstance();
+	while (true)
+	{
+		XrdSysTimer::Wait(config.m_stats_interval*1000);
+		dump(config.m_stats_path);
+	}
+}
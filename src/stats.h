@@ -0,0 +1,126 @@
+#ifndef __STATS_H_
+#define __STATS_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include "XrdSys/XrdSysPthread.hh"
+
+namespace ClassadXrootdMapping {
+
+enum StatCounter {
+	StatCalls,              // files_to_sites evaluations
+	StatCallErrors,
+	StatMemoHits,           // Evaluations answered whole by the result memo.
+	StatCacheHits,          // Files answered by the cache...
+	StatCacheStaleHits,     // ...of which with an expired answer, during its grace period.
+	StatCacheMisses,
+	StatSnapshotHits,       // Misses answered by the startup snapshot.
+	StatCatalogHits,        // Files answered by the catalog, before the cache.
+	StatGuesses,            // Misses answered from their directory.
+	StatCacheInserts,
+	StatCacheEvictions,
+	StatCacheExpirations,
+	StatLockContention,     // Cache shard locks found busy.
+	StatLocates,            // Requests sent to a redirector.
+	StatLocateBatches,      // Batches they were sent in.
+	StatLocatesJoined,      // Lookups that joined a request already in flight.
+	StatDeepLocates,        // Requests sent to the managers below a redirector.
+	StatManagerCacheHits,   // Requests sent straight to remembered managers.
+	StatLocateSendFailures,
+	StatLocateFound,
+	StatLocateNotFound,
+	StatLocateErrors,
+	StatLocateTimeouts,
+	StatMapMisses,          // Redirectors that answered nothing within the budget.
+	StatHedges,             // Requests sent to a second redirector.
+	StatBreakerOpens,
+	StatBreakerRejects,     // Lookups skipped because the redirector was considered down.
+	StatDnsLookups,
+	StatDnsFailures,
+	StatCounterCount
+};
+
+enum StatHistogram {
+	StatCallLatency,   // Whole files_to_sites evaluations.
+	StatLocateLatency, // From sending a request to its response.
+	StatDnsLatency,    // One reverse lookup.
+	StatHistogramCount
+};
+
+/*
+ * Process-wide counters and latency histograms.
+ *
+ * Updates are single atomic adds, so they can sit on the hot path; a
+ * reader may see the counters mid-update, which is fine for monitoring.
+ * Histograms have power-of-two buckets in microseconds.
+ */
+class Stats {
+
+public:
+
+	static Stats &getInstance();
+
+	void inc(StatCounter counter, unsigned long long count = 1);
+
+	void record(StatHistogram histogram, uint64_t latency_us);
+
+	// Every statistic, by ClassAd attribute name.  Latencies are reported
+	// as percentiles, in microseconds; the cache and client sizes are
+	// sampled as well.
+	void collect(std::vector<std::pair<std::string, long long> > &values);
+
+private:
+
+	Stats();
+
+	uint64_t percentile(const unsigned long long *buckets, unsigned long long count, unsigned int permille) const;
+
+	// Writes collect() to a file, one "Name = value" line per statistic.
+	bool dump(const std::string &path);
+	void dumpLoop();
+	static void *dumpThread(void *);
+
+	static void createInstance();
+
+	static const unsigned int m_bucket_count = 40; // Bucket i counts latencies below 2^i us.
+
+	unsigned long long m_counters[StatCounterCount];
+	unsigned long long m_buckets[StatHistogramCount][m_bucket_count];
+
+	XrdSysMutex m_atomic_mutex; // Only used where there are no atomics.
+
+	static Stats * m_instance;
+	static pthread_once_t m_instance_once;
+};
+
+/*
+ * Like XrdSysRWLockHelper, but counts the times the lock was busy.
+ */
+class CountingRWLockHelper {
+
+public:
+
+	CountingRWLockHelper(XrdSysRWLock &lock, bool read) : m_lock(lock)
+	{
+		if (read ? lock.CondReadLock() : lock.CondWriteLock())
+			return;
+		Stats::getInstance().inc(StatLockContention);
+		if (read)
+			lock.ReadLock();
+		else
+			lock.WriteLock();
+	}
+
+	~CountingRWLockHelper() { m_lock.UnLock(); }
+
+private:
+
+	XrdSysRWLock &m_lock;
+};
+
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef __TESTUTILS_H_
+#define __TESTUTILS_H_
+
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace ClassadXrootdMapping {
+
+/*
+ * Checks for the test programs run by ctest.  A program makes all its
+ * checks, each failure printed as it happens, and returns finishTests()
+ * from main(), so ctest sees every failure of a run at once.
+ */
+inline unsigned int &testFailures()
+{
+	static unsigned int failures = 0;
+	return failures;
+}
+
+inline void check(bool ok, const std::string &what)
+{
+	if (!ok)
+	{
+		std::cout << "FAILED: " << what << std::endl;
+		testFailures()++;
+	}
+}
+
+template <typename T>
+void checkEqual(const T &found, const T &expected, const std::string &what)
+{
+	std::stringstream message;
+	message << what << ": expected " << expected << ", got " << found;
+	check(found == expected, message.str());
+}
+
+// Returns the exit status for main().
+inline int finishTests(const std::string &suite)
+{
+	if (testFailures())
+	{
+		std::cout << testFailures() << " " << suite << " checks failed." << std::endl;
+		return 1;
+	}
+	std::cout << "All " << suite << " checks passed." << std::endl;
+	return 0;
+}
+
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef __TIME_UTILS_H_
+#define __TIME_UTILS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Milliseconds from a clock that never jumps with the wall time;
+ * only useful for computing deadlines and intervals.
+ */
+inline uint64_t monotonic_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+/*
+ * The same clock, in microseconds, for measuring latencies.
+ */
+inline uint64_t monotonic_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+/*
+ * Sleeps for a short interval, below the millisecond granularity of
+ * XrdSysTimer.
+ */
+inline void sleep_us(unsigned int interval_us)
+{
+	struct timespec ts;
+	ts.tv_sec = interval_us / 1000000;
+	ts.tv_nsec = static_cast<long>(interval_us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) == -1) {}
+}
+
+/*
+ * Milliseconds left until the deadline; 0 if it has passed.
+ */
+inline unsigned int remaining_ms(uint64_t deadline)
+{
+	uint64_t now = monotonic_ms();
+	return (now < deadline) ? static_cast<unsigned int>(deadline - now) : 0;
+}
+
+#endif
@@ -1,92 +1,757 @@
 
-#include <netinet/in.h>
+#include <algorithm>
+#include <sstream>
+
 #include "xrootd_client.h"
 #include "response_cache.h"
+#include "manager_cache.h"
+#include "deep_locate.h"
+#include "catalog.h"
+#include "hostname_cache.h"
+#include "config.h"
+#include "time_utils.h"
+#include "stats.h"
 
 #include "XrdCl/XrdClFileSystem.hh"
-#include "XrdSys/XrdSysDNS.hh"
+#include "XrdSys/XrdSysTimer.hh"
+#include "XProtocol/XProtocol.hh"
 
 using namespace classad;
 using namespace ClassadXrootdMapping;
 using namespace XrdCl;
 
-InstanceTable FileMappingClient::m_instance_table;
+InstanceTable * volatile FileMappingClient::m_instance_table = new InstanceTable();
+std::vector<InstanceTable *> FileMappingClient::m_retired_tables;
 XrdSysMutex FileMappingClient::m_table_mutex;
+pthread_once_t FileMappingClient::m_reaper_once = PTHREAD_ONCE_INIT;
+MappedCatalog *FileMappingClient::m_catalog = NULL;
+pthread_once_t FileMappingClient::m_catalog_once = PTHREAD_ONCE_INIT;
+XrdClBackend FileMappingClient::m_xrdcl_backend;
+LocateBackend *FileMappingClient::m_backend = &FileMappingClient::m_xrdcl_backend;
+
+const unsigned int FileMappingClient::m_budget_ms = 50;
+const unsigned int FileMappingClient::m_min_budget_ms = 5;
+const unsigned int FileMappingClient::m_partial_lifetime_seconds = 5;
+const unsigned int FileMappingClient::m_reap_interval_seconds = 60;
 
 /*
  *  Manage file mapping
  */
-FileMappingClient & FileMappingClient::getClient(const std::string &hostname) {
-	FileMappingClient *client = NULL;
+FileMappingClient * FileMappingClient::getClient(const std::string &hostname) {
+	pthread_once(&m_reaper_once, startReaper);
+
+	InstanceTable *table = m_instance_table;
+	InstanceTable::const_iterator result = table->find(hostname);
+	if (result != table->end() && result->second->tryAcquire()) {
+		return result->second;
+	}
+
+	RedirectorId redirector;
+	if (!HostTable::getRedirectorTable().intern(hostname, redirector))
+		return NULL;
+
+	// Clients are only retired with this mutex held, so one still in the
+	// published table can be acquired.
 	XrdSysMutexHelper lock(m_table_mutex);
-	InstanceTable::const_iterator result = m_instance_table.find(hostname);
-	if (result == m_instance_table.end()) {
-		FileMappingClient *new_client = new FileMappingClient(hostname);
-		m_instance_table[hostname] = new_client;
-		client = new_client;
-	} else {
-		client = result->second;
+	table = m_instance_table;
+	result = table->find(hostname);
+	if (result != table->end()) {
+		result->second->Acquire();
+		return result->second;
 	}
-	return *client;
+	FileMappingClient *new_client = new FileMappingClient(hostname, redirector);
+	InstanceTable *new_table = new InstanceTable(*table);
+	(*new_table)[hostname] = new_client;
+	// The table contents must be visible before the pointer to it.
+#ifdef HAVE_ATOMICS
+	__sync_synchronize();
+#endif
+	m_instance_table = new_table;
+	m_retired_tables.push_back(table);
+	return new_client;
 }
 
-bool FileMappingClient::map(const std::vector<std::string> &filenames, std::set<std::string> &hosts) {
+size_t
+FileMappingClient::getClientCount()
+{
+	return m_instance_table->size();
+}
 
-	ResponseCache& cache = ResponseCache::getInstance();
+void
+FileMappingClient::Acquire()
+{
+	XrdSysMutexHelper lock(m_mutex);
+	m_refs++;
+}
 
-	for (std::vector<std::string>::const_iterator it = filenames.begin(); it != filenames.end(); ++it)
+bool
+FileMappingClient::tryAcquire()
+{
+	XrdSysMutexHelper lock(m_mutex);
+	if (m_retired)
+		return false;
+	m_refs++;
+	return true;
+}
+
+/*
+ * Never deletes the client; that is left to the reaper once it is idle.
+ */
+void
+FileMappingClient::Release()
+{
+	XrdSysMutexHelper lock(m_mutex);
+	m_refs--;
+	m_last_used = time(NULL);
+}
+
+void
+FileMappingClient::openCatalog()
+{
+	const Config &config = Config::getInstance();
+	if (!config.m_catalog_path.empty())
+		m_catalog = MappedCatalog::open(config.m_catalog_path);
+}
+
+bool
+FileMappingClient::searchCatalog(const std::vector<std::string> &filenames, HostSet &hosts,
+	std::vector<std::string> &misses, std::vector<HostSet> *file_hosts)
+{
+	pthread_once(&m_catalog_once, openCatalog);
+	if (!m_catalog)
+		return false;
+
+	for (size_t idx = 0; idx < filenames.size(); idx++)
 	{
-		std::set<std::string> temp_set;
-		locate(*it, temp_set);
-		cache.insert(*it, temp_set);
-		hosts.insert(temp_set.begin(), temp_set.end());
+		if (!m_catalog->lookup(filenames[idx], file_hosts ? (*file_hosts)[idx] : hosts))
+			misses.push_back(filenames[idx]);
+		else if (file_hosts)
+			hosts.merge((*file_hosts)[idx]);
 	}
-
+	if (misses.size() < filenames.size())
+		Stats::getInstance().inc(StatCatalogHits, filenames.size() - misses.size());
 	return true;
 }
 
-FileMappingClient::FileMappingClient(const std::string &hostname)
-	: m_url("root://" + hostname),
-	m_host(hostname),
-	m_fs(m_url)
+bool
+FileMappingClient::lookupCatalog(const std::string &filename, HostSet &hosts)
+{
+	pthread_once(&m_catalog_once, openCatalog);
+	return m_catalog && m_catalog->lookup(filename, hosts);
+}
+
+XRootDStatus
+XrdClBackend::locate(FileSystem &fs, const std::string &, const std::string &path, ResponseHandler *handler, uint16_t timeout)
+{
+	return fs.Locate(path, OpenFlags::NoWait, handler, timeout);
+}
+
+void
+FileMappingClient::setBackend(LocateBackend &backend)
+{
+	m_backend = &backend;
+}
+
+XrdCl::FileSystem &
+FileMappingClient::getFileSystem()
+{
+	XrdSysMutexHelper lock(m_mutex);
+	return *m_pool[m_next_fs++ % m_pool.size()];
+}
+
+void
+FileMappingClient::startReaper()
 {
+	pthread_t tid;
+	XrdSysThread::Run(&tid, reaperThread, NULL, 0, "Idle client reaper");
+}
+
+void *
+FileMappingClient::reaperThread(void *)
+{
+	reapLoop();
+	return NULL;
+}
+
+void
+FileMappingClient::reapLoop()
+{
+	const Config &config = Config::getInstance();
+	// Retired on the previous pass; nobody can still be looking at them.
+	std::vector<InstanceTable *> old_tables;
+	std::vector<FileMappingClient *> old_clients;
+	while (true)
+	{
+		XrdSysTimer::Wait(m_reap_interval_seconds*1000);
+		time_t now = time(NULL);
+
+		for (std::vector<InstanceTable *>::iterator it = old_tables.begin(); it != old_tables.end(); ++it)
+		{
+			delete *it;
+		}
+		old_tables.clear();
+		for (std::vector<FileMappingClient *>::iterator it = old_clients.begin(); it != old_clients.end(); ++it)
+		{
+			delete *it;
+		}
+		old_clients.clear();
+
+		XrdSysMutexHelper lock(m_table_mutex);
+		old_tables.swap(m_retired_tables);
+
+		InstanceTable *table = m_instance_table;
+		for (InstanceTable::const_iterator it = table->begin(); it != table->end(); ++it)
+		{
+			FileMappingClient *client = it->second;
+			// A retired client can take no new reference, so it stays idle.
+			XrdSysMutexHelper client_lock(client->m_mutex);
+			if (!client->m_refs && now - client->m_last_used >= static_cast<time_t>(config.m_client_idle))
+			{
+				client->m_retired = true;
+				old_clients.push_back(client);
+			}
+		}
+		if (old_clients.empty())
+			continue;
+
+		InstanceTable *new_table = new InstanceTable(*table);
+		for (std::vector<FileMappingClient *>::const_iterator it = old_clients.begin(); it != old_clients.end(); ++it)
+		{
+			new_table->erase((*it)->m_host);
+		}
+#ifdef HAVE_ATOMICS
+		__sync_synchronize();
+#endif
+		m_instance_table = new_table;
+		old_tables.push_back(table);
+	}
 }
 
 bool
-FileMappingClient::locate(const std::string &path, std::set<std::string> &hosts) {
+FileMappingClient::getScope(const std::vector<std::string> &hostnames, RedirectorId &scope)
+{
+	std::string name;
+	for (std::vector<std::string>::const_iterator it = hostnames.begin(); it != hostnames.end(); ++it)
+	{
+		if (it != hostnames.begin())
+			name += ",";
+		name += *it;
+	}
+	return HostTable::getRedirectorTable().intern(name, scope);
+}
 
-	// I hate the pointer ownership here...
-    FileMappingResponseHandler *handler_ptr = new FileMappingResponseHandler();
+namespace {
 
-	XRootDStatus status = m_fs.Locate(path, OpenFlags::NoWait, handler_ptr, 0);
- 
-	if (!status.IsOK())
-	{ // TODO: log message
-		return false;
+struct LatencyOrder {
+	bool operator()(const std::pair<unsigned int, FileMappingClient *> &left,
+		const std::pair<unsigned int, FileMappingClient *> &right) const
+	{
+		return left.first < right.first;
+	}
+};
+
+}
+
+void
+FileMappingClient::sortByPreference(std::vector<FileMappingClient *> &clients)
+{
+	if (clients.size() < 2)
+		return;
+
+	// Sample each average once; they may move while we sort.
+	std::vector<std::pair<unsigned int, FileMappingClient *> > order;
+	order.reserve(clients.size());
+	for (std::vector<FileMappingClient *>::const_iterator it = clients.begin(); it != clients.end(); ++it)
+	{
+		order.push_back(std::make_pair((*it)->getLatency(), *it));
+	}
+	std::stable_sort(order.begin(), order.end(), LatencyOrder());
+	for (size_t idx = 0; idx < order.size(); idx++)
+	{
+		clients[idx] = order[idx].second;
 	}
+}
+
+bool FileMappingClient::map(const std::vector<std::string> &filenames, HostSet &hosts) {
+
+	return map(std::vector<FileMappingClient *>(1, this), m_redirector, filenames, hosts);
+}
 
-	if (handler_ptr->WaitForResponseMS(50))
+bool FileMappingClient::map(const std::vector<FileMappingClient *> &clients, RedirectorId scope,
+	const std::vector<std::string> &filenames, HostSet &hosts, std::vector<HostSet> *file_hosts) {
+
+	unsigned int budget_ms = 0;
+	for (std::vector<FileMappingClient *>::const_iterator it = clients.begin(); it != clients.end(); ++it)
 	{
-		// Timeout - handler object will report directly to cache.
-		// Note that we leak the handler object - it will delete itself.
+		budget_ms = std::max(budget_ms, (*it)->getBudget());
+	}
+
+	// All the files share one deadline, so the worst case does not grow
+	// with the number of files in the ad.
+	uint64_t deadline = monotonic_ms() + budget_ms;
+	unsigned int hedge_ms = budget_ms * Config::getInstance().m_hedge_percent / 100;
+
+	// Redirectors whose breaker is open are skipped outright; if that is
+	// all of them, the caller makes do with what the cache had.  Admission
+	// is only asked for right before sending, as it may hand out the probe.
+	std::vector<FileMappingClient *> admitted;
+	std::vector<FileMappingClient *>::const_iterator candidate = clients.begin();
+	for (; candidate != clients.end() && !(*candidate)->admit(); ++candidate) {}
+	if (candidate == clients.end())
 		return true;
+	admitted.push_back(*candidate++);
+
+	// Send every request before waiting on any of them; the redirector
+	// works on all of them in parallel.  attempts[idx] holds the requests
+	// for filenames[idx], one per redirector asked.
+	std::vector<std::vector<FileMappingResponseHandler *> > attempts(filenames.size());
+	std::vector<bool> answered(filenames.size(), false);
+	LocateWaiter waiter(filenames.size());
+	for (size_t idx = 0; idx < filenames.size(); idx++)
+	{
+		FileMappingResponseHandler *handler = admitted[0]->locate(scope, filenames[idx]);
+		handler->AddWaiter(&waiter, idx);
+		attempts[idx].push_back(handler);
 	}
-	std::auto_ptr<FileMappingResponseHandler> handler(handler_ptr);
-	XRootDStatus hstatus;
-    if (!handler->GetStatus(hstatus) || !hstatus.IsOK())
+
+	while (true)
 	{
-		return false;
+		uint64_t stage_deadline = deadline;
+		if (candidate != clients.end())
+			stage_deadline = std::min(deadline, monotonic_ms() + hedge_ms);
+
+		if (!collect(attempts, answered, hosts, file_hosts, waiter, stage_deadline) ||
+			candidate == clients.end() || !remaining_ms(deadline))
+			break;
+
+		for (; candidate != clients.end() && !(*candidate)->admit(); ++candidate) {}
+		if (candidate == clients.end())
+		{
+			// Nobody left to hedge with; wait out the budget.
+			collect(attempts, answered, hosts, file_hosts, waiter, deadline);
+			break;
+		}
+
+		// Hedge: the next redirector races the earlier ones for the rest.
+		FileMappingClient *client = *candidate++;
+		Stats::getInstance().inc(StatHedges);
+		for (size_t idx = 0; idx < filenames.size(); idx++)
+		{
+			FileMappingResponseHandler *handler = NULL;
+			if (!answered[idx])
+			{
+				handler = client->locate(scope, filenames[idx]);
+				handler->AddWaiter(&waiter, idx);
+			}
+			attempts[idx].push_back(handler);
+		}
+		admitted.push_back(client);
+	}
+
+	// On timeout, the handlers register the late answers in the cache themselves.
+	// A redirector that answered none of its requests in time has missed.
+	for (size_t client_idx = 0; client_idx < admitted.size(); client_idx++)
+	{
+		bool missed = false, responded = false;
+		for (size_t idx = 0; idx < attempts.size(); idx++)
+		{
+			if (!attempts[idx][client_idx])
+				continue;
+			if (attempts[idx][client_idx]->isValid())
+				responded = true;
+			else
+				missed = true;
+		}
+		if (missed && !responded)
+			admitted[client_idx]->recordMiss();
 	}
-	LocationInfo info;
-	if (!handler->GetResponse(info))
+	for (size_t idx = 0; idx < attempts.size(); idx++)
+	{
+		for (size_t attempt = 0; attempt < attempts[idx].size(); attempt++)
+		{
+			if (!attempts[idx][attempt])
+				continue;
+			// The waiter goes out of scope; late responses must not touch it.
+			attempts[idx][attempt]->RemoveWaiter(&waiter);
+			attempts[idx][attempt]->Release();
+		}
+	}
+
+	return true;
+}
+
+bool
+FileMappingClient::collect(std::vector<std::vector<FileMappingResponseHandler *> > &attempts,
+	std::vector<bool> &answered, HostSet &hosts, std::vector<HostSet> *file_hosts,
+	LocateWaiter &waiter, uint64_t deadline)
+{
+	// Returns early if every redirector asked has already failed the files
+	// still unanswered; the next one should be asked right away.
+	waiter.wait(deadline);
+
+	bool unanswered = false;
+	for (size_t idx = 0; idx < attempts.size(); idx++)
 	{
+		const std::vector<FileMappingResponseHandler *> &handlers = attempts[idx];
+		for (size_t attempt = 0; attempt < handlers.size() && !answered[idx]; attempt++)
+		{
+			if (handlers[attempt] && handlers[attempt]->GetHosts(file_hosts ? (*file_hosts)[idx] : hosts))
+				answered[idx] = true;
+		}
+		if (answered[idx] && file_hosts)
+			hosts.merge((*file_hosts)[idx]);
+		if (!answered[idx])
+			unanswered = true;
+	}
+	return unanswered;
+}
+
+bool FileMappingClient::prefetch(const std::vector<std::string> &filenames) {
+
+	return prefetch(m_redirector, filenames);
+}
+
+bool FileMappingClient::prefetch(RedirectorId scope, const std::vector<std::string> &filenames) {
+
+	if (filenames.empty())
+		return true;
+	if (!admit())
 		return false;
+	for (std::vector<std::string>::const_iterator it = filenames.begin(); it != filenames.end(); ++it)
+	{
+		locate(scope, *it)->Release();
 	}
+	return true;
+}
 
-	for (LocationInfo::ConstIterator it = info.Begin(); it!=info.End(); it++)
+bool FileMappingClient::prefetch(const std::vector<FileMappingClient *> &clients, RedirectorId scope,
+	const std::vector<std::string> &filenames) {
+
+	if (filenames.empty())
+		return true;
+	for (std::vector<FileMappingClient *>::const_iterator it = clients.begin(); it != clients.end(); ++it)
 	{
+		if ((*it)->prefetch(scope, filenames))
+			return true;
+	}
+	return false;
+}
 
-		it->GetAddress();
+bool
+FileMappingClient::admit()
+{
+	XrdSysMutexHelper lock(m_mutex);
+	uint64_t now_ms;
+	switch (m_breaker)
+	{
+		case BreakerClosed:
+			return true;
+		case BreakerOpen:
+			now_ms = monotonic_ms();
+			if (now_ms < m_open_until_ms)
+				break;
+			m_breaker = BreakerHalfOpen;
+			m_probe_until_ms = now_ms + static_cast<uint64_t>(Config::getInstance().m_locate_timeout)*1000;
+			return true;
+		case BreakerHalfOpen:
+			// XrdCl would have timed the probe out by now; it was lost
+			// somewhere, so the breaker must not wait on it forever.
+			now_ms = monotonic_ms();
+			if (now_ms >= m_probe_until_ms)
+				recordFailure(now_ms);
+			break;
+	}
+	Stats::getInstance().inc(StatBreakerRejects);
+	return false;
+}
+
+/*
+ * Must be called with m_mutex held.
+ */
+void
+FileMappingClient::recordFailure(uint64_t now_ms)
+{
+	m_failures++;
+	// A failed probe reopens the breaker at once.
+	if (m_breaker == BreakerHalfOpen ||
+		(m_breaker == BreakerClosed && m_failures >= Config::getInstance().m_breaker_failures))
+	{
+		m_breaker = BreakerOpen;
+		m_open_until_ms = now_ms + static_cast<uint64_t>(Config::getInstance().m_breaker_open)*1000;
+		Stats::getInstance().inc(StatBreakerOpens);
+	}
+}
+
+bool
+FileMappingClient::isProbing()
+{
+	XrdSysMutexHelper lock(m_mutex);
+	return m_breaker == BreakerHalfOpen;
+}
+
+void
+FileMappingClient::recordMiss()
+{
+	uint64_t now_ms = monotonic_ms();
+	Stats::getInstance().inc(StatMapMisses);
+	XrdSysMutexHelper lock(m_mutex);
+	recordFailure(now_ms);
+}
+
+void
+FileMappingClient::recordLatency(uint64_t latency_us, bool answered)
+{
+	// Anything slower than the largest budget is as bad as a failure.
+	uint64_t sample_us = latency_us;
+	if (!answered || sample_us > static_cast<uint64_t>(m_budget_ms)*1000)
+		sample_us = static_cast<uint64_t>(m_budget_ms)*1000;
+
+	XrdSysMutexHelper lock(m_mutex);
+	if (!m_measured)
+	{
+		m_latency_us = sample_us;
+		m_deviation_us = sample_us / 2;
+		m_measured = true;
+	}
+	else
+	{
+		// Same weights as TCP: 1/8 for the mean, 1/4 for the deviation.
+		uint64_t distance = (sample_us > m_latency_us) ? sample_us - m_latency_us : m_latency_us - sample_us;
+		m_deviation_us = static_cast<unsigned int>((static_cast<uint64_t>(m_deviation_us)*3 + distance) / 4);
+		m_latency_us = static_cast<unsigned int>((static_cast<uint64_t>(m_latency_us)*7 + sample_us) / 8);
+	}
+
+	if (answered)
+	{
+		m_failures = 0;
+		m_breaker = BreakerClosed;
+	}
+	else
+	{
+		recordFailure(monotonic_ms());
+	}
+}
+
+unsigned int
+FileMappingClient::getBudget()
+{
+	XrdSysMutexHelper lock(m_mutex);
+	if (!m_measured)
+		return m_budget_ms;
+	unsigned int budget_ms = (m_latency_us + 4*m_deviation_us + 999) / 1000;
+	return std::min(m_budget_ms, std::max(m_min_budget_ms, budget_ms));
+}
+
+unsigned int
+FileMappingClient::getLatency()
+{
+	XrdSysMutexHelper lock(m_mutex);
+	// Until it has answered, a redirector ranks as slow as the largest budget.
+	if (!m_measured)
+		return m_budget_ms*1000;
+	return m_latency_us;
+}
+
+FileMappingClient::FileMappingClient(const std::string &hostname, RedirectorId redirector)
+	: m_host(hostname),
+	m_redirector(redirector),
+	m_refs(1),
+	m_retired(false),
+	m_last_used(time(NULL)),
+	m_next_fs(0),
+	m_latency_us(0),
+	m_deviation_us(0),
+	m_measured(false),
+	m_breaker(BreakerClosed),
+	m_failures(0),
+	m_open_until_ms(0),
+	m_probe_until_ms(0),
+	m_stopping(false),
+	m_submit_cond(0)
+{
+	// XrdCl shares one connection among all FileSystems for the same
+	// host and login; a distinct login name per FileSystem gets each its own.
+	unsigned int connections = Config::getInstance().m_connections;
+	m_pool.reserve(connections);
+	m_pool.push_back(new XrdCl::FileSystem(XrdCl::URL("root://" + hostname)));
+	for (unsigned int idx = 1; idx < connections; idx++)
+	{
+		std::stringstream url;
+		url << "root://cxm" << idx << "@" << hostname;
+		m_pool.push_back(new XrdCl::FileSystem(XrdCl::URL(url.str())));
+	}
+
+	m_threaded = !XrdSysThread::Run(&m_sender, senderThread, this, XRDSYSTHREAD_HOLD, "Locate sender");
+}
+
+/*
+ * Only the reaper deletes clients, once unreferenced; every queued request
+ * holds a reference, so the sender has nothing left to send.
+ */
+FileMappingClient::~FileMappingClient()
+{
+	if (m_threaded)
+	{
+		{
+			XrdSysCondVarHelper monitor(m_submit_cond);
+			m_stopping = true;
+			m_submit_cond.Signal();
+		}
+		XrdSysThread::Join(m_sender, NULL);
+	}
+
+	for (std::vector<XrdCl::FileSystem *>::iterator it = m_pool.begin(); it != m_pool.end(); ++it)
+	{
+		delete *it;
+	}
+}
+
+/*
+ * Send an asynchronous locate request, or join the one already outstanding
+ * for this path and scope.  The caller owns one reference to the returned
+ * handler.
+ */
+FileMappingResponseHandler *
+FileMappingClient::locate(RedirectorId scope, const std::string &path) {
+
+	std::string key = CacheEntry::makeKey(scope, path);
+	FileMappingResponseHandler *handler;
+	{
+		XrdSysMutexHelper lock(m_pending_mutex);
+		PendingTable::const_iterator result = m_pending.find(key);
+		if (result != m_pending.end()) {
+			result->second->Acquire();
+			Stats::getInstance().inc(StatLocatesJoined);
+			return result->second;
+		}
+		handler = new FileMappingResponseHandler(*this, scope, path);
+		m_pending[key] = handler;
+	}
+
+	if (!m_threaded)
+	{
+		Stats::getInstance().inc(StatLocateBatches);
+		send(handler);
+		return handler;
+	}
+
+	// The queue holds the reference meant for XrdCl until the request is sent.
+	{
+		XrdSysCondVarHelper monitor(m_submit_cond);
+		m_submissions.push_back(handler);
+		// The sender only sleeps on an empty queue.
+		if (m_submissions.size() == 1)
+			m_submit_cond.Signal();
+	}
+	return handler;
+}
+
+void
+FileMappingClient::send(FileMappingResponseHandler *handler)
+{
+	// Where a deep locate already found the managers for this directory,
+	// skip the levels above them.  Not for the breaker's probe, though:
+	// only the redirector's own answer can close the breaker.
+	std::vector<std::string> managers;
+	if (Config::getInstance().m_deep_locate && !isProbing() &&
+		ManagerCache::getInstance().lookup(m_redirector, handler->GetPath(), managers))
+	{
+		Stats::getInstance().inc(StatManagerCacheHits);
+		(new DeepLocate(*handler, *this, handler->GetPath(), NULL, HostSet(), true))->follow(managers, 1);
+		return;
+	}
+
+	Stats::getInstance().inc(StatLocates);
+	XRootDStatus status = sendLocate(handler->GetPath(), handler);
+
+	if (!status.IsOK())
+	{ // TODO: log message
+		Stats::getInstance().inc(StatLocateSendFailures);
+		// XrdCl will never call back; complete the request ourselves so
+		// anyone who joined it in the meantime is woken up.
+		handler->HandleResponse(new XRootDStatus(status), NULL);
+	}
+}
+
+XRootDStatus
+FileMappingClient::sendLocate(const std::string &path, ResponseHandler *handler)
+{
+	return m_backend->locate(getFileSystem(), m_host, path, handler, Config::getInstance().m_locate_timeout);
+}
+
+void *
+FileMappingClient::senderThread(void *arg)
+{
+	static_cast<FileMappingClient*>(arg)->sendLoop();
+	return NULL;
+}
+
+/*
+ * Send the queued requests in batches: everything queued while the
+ * previous batch was being sent goes out back to back, and XrdCl
+ * pipelines them over the connections.  With a submit window, the sender
+ * also waits that long after the first request for others to join it.
+ */
+void
+FileMappingClient::sendLoop()
+{
+	unsigned int window_us = Config::getInstance().m_submit_window_us;
+	std::vector<FileMappingResponseHandler *> batch;
+	while (true)
+	{
+		{
+			XrdSysCondVarHelper monitor(m_submit_cond);
+			while (m_submissions.empty() && !m_stopping)
+				m_submit_cond.Wait();
+			if (m_submissions.empty())
+				return;
+		}
+
+		// Anything queued meanwhile needs no signal; the queue is not empty.
+		if (window_us)
+			sleep_us(window_us);
+
+		{
+			XrdSysCondVarHelper monitor(m_submit_cond);
+			batch.swap(m_submissions);
+		}
+		Stats::getInstance().inc(StatLocateBatches);
+		for (std::vector<FileMappingResponseHandler *>::const_iterator it = batch.begin(); it != batch.end(); ++it)
+		{
+			send(*it);
+		}
+		batch.clear();
+	}
+}
+
+/*
+ * Called by the handler once its response is in the cache.
+ */
+void
+FileMappingClient::finished(RedirectorId scope, const std::string &path) {
+	std::string key = CacheEntry::makeKey(scope, path);
+	XrdSysMutexHelper lock(m_pending_mutex);
+	m_pending.erase(key);
+}
+
+/*
+ * Returns false if some addresses are still waiting on the hostname cache;
+ * those are left out of the result.
+ */
+bool
+FileMappingClient::translate(const LocationInfo &info, HostSet &hosts, std::vector<std::string> *managers) {
+
+	HostnameCache &hostname_cache = HostnameCache::getInstance();
+	HostTable &host_table = HostTable::getInstance();
+	bool complete = true;
+
+	for (LocationInfo::ConstIterator it = info.Begin(); it!=info.End(); it++)
+	{
+		if (managers && it->IsManager())
+		{
+			managers->push_back(it->GetAddress());
+			continue;
+		}
 
 		// Transform the response string to an endpoint.
 		// If an IPv4 address, we cannot treat it as an opaque string.
@@ -98,46 +763,131 @@ FileMappingClient::locate(const std::string &path, std::set<std::string> &hosts)
 		}
 		// The above will not be necessary when Host2Dest supports IPv6.
 
-		// This union trick is to make sure we get enough memory for the sockaddr and that
-		// things are exception-safe.
-		std::vector<char> sock_mem;
-		sock_mem.reserve(std::max(sizeof(struct sockaddr_in), sizeof(struct sockaddr_in6)));
-		typedef union {struct sockaddr* addr; char * memory;} sockaddr_big;
-		sockaddr_big addr;
-		addr.memory = &sock_mem[0];
-		if (!XrdSysDNS::Host2Dest(single_entry_copy.c_str(), *(addr.addr), 0))
+		std::string hostname;
+		HostId host_id;
+		switch (hostname_cache.lookup(single_entry_copy, hostname))
 		{
-			//Error("locate", "Invalid IP address: " << single_entry_copy);
-			continue;
+			case HostnameCache::Resolved:
+				if (host_table.intern(hostname, host_id))
+					hosts.insert(host_id);
+				break;
+			case HostnameCache::Pending:
+				complete = false;
+				break;
+			case HostnameCache::Unresolvable:
+				//Error("locate", "Invalid IP address: " << single_entry_copy);
+				break;
 		}
-
-		char * hostname_result = XrdSysDNS::getHostName(*(addr.addr), NULL);
-		std::string hostname(hostname_result);
-		free(hostname_result);
-
-		hosts.insert(hostname);
 	}
-	return true;
+	return complete;
+}
+
+LookupOutcome
+FileMappingClient::classify(const XRootDStatus &status, const LocationInfo *info)
+{
+	if (status.IsOK())
+		return (info && info->GetSize()) ? LookupFound : LookupNotFound;
+	if (status.code == errErrorResponse && status.errNo == kXR_NotFound)
+		return LookupNotFound;
+	if (status.code == errOperationExpired || status.code == errSocketTimeout)
+		return LookupTimedOut;
+	return LookupError;
 }
 
 void FileMappingResponseHandler::HandleResponse( XrdCl::XRootDStatus *status, XrdCl::AnyObject *response )
 {
-	XrdSysCondVarHelper sentry(pCond);
-	pStatus = status;
-	pResponse = response;
-	// Do not allow re-ordering of the above assignments
-	// after the below AtomicInc.  If there are no atomics,
-	// everything is protected by a mutex and we can safely
-	// skip the call.
-#ifdef HAVE_ATOMICS
-	__sync_synchronize();
-#endif
-	AtomicInc(pValid);
-	pCond.Broadcast();
+	LocationInfo *linfo = 0;
+	if (status->IsOK() && response)
+		response->Get(linfo);
+	LookupOutcome outcome = FileMappingClient::classify(*status, linfo);
 
-	if (pWaitedOnce)
+	HostSet hosts;
+	bool complete = true;
+	std::vector<std::string> managers;
+	if (linfo)
+		complete = FileMappingClient::translate(*linfo, hosts,
+			Config::getInstance().m_deep_locate ? &managers : NULL);
+	delete response;
+
+	uint64_t latency_us = monotonic_us() - pStart;
+	pClient.recordLatency(latency_us, outcome == LookupFound || outcome == LookupNotFound);
+	Stats::getInstance().record(StatLocateLatency, latency_us);
+
+	if (!managers.empty())
 	{
-		// TODO: Register the file in the cache ourselve.
+		// The deep locate completes the request, possibly before follow()
+		// returns; this handler may be gone by then.
+		(new DeepLocate(*this, pClient, pPath, status, hosts, complete))->follow(managers, 1);
+		return;
 	}
+	Complete(status, hosts, complete, outcome);
 }
 
+void
+FileMappingResponseHandler::DeepFinished(XrdCl::XRootDStatus *status, HostSet &hosts, bool complete,
+	LookupOutcome outcome, bool shortcut)
+{
+	if (shortcut && outcome != LookupFound)
+	{
+		// The managers we remembered no longer know the file; the
+		// redirector may know better.
+		ManagerCache::getInstance().forget(pClient.getRedirector(), pPath);
+		delete status;
+		Stats::getInstance().inc(StatLocates);
+		XRootDStatus sent = pClient.sendLocate(pPath, this);
+		if (!sent.IsOK())
+		{
+			Stats::getInstance().inc(StatLocateSendFailures);
+			HandleResponse(new XRootDStatus(sent), NULL);
+		}
+		return;
+	}
+	// The remembered managers may hold only some of the replicas the
+	// redirector would name, so cache their answer only as a partial one.
+	Complete(status, hosts, complete && !shortcut, outcome);
+}
+
+void
+FileMappingResponseHandler::Complete(XrdCl::XRootDStatus *status, HostSet &hosts, bool complete, LookupOutcome outcome)
+{
+	Stats &stats = Stats::getInstance();
+	switch (outcome)
+	{
+		case LookupFound: stats.inc(StatLocateFound); break;
+		case LookupNotFound: stats.inc(StatLocateNotFound); break;
+		case LookupError: stats.inc(StatLocateErrors); break;
+		case LookupTimedOut: stats.inc(StatLocateTimeouts); break;
+	}
+	// Register the file in the cache ourselves; the callers may have given
+	// up waiting already.  Each outcome is kept for its own lifetime.
+	// If the answer is partial, as when some hostnames were not resolved
+	// yet, only keep it until a fuller one can be had.
+	if (complete)
+		ResponseCache::getInstance().insert(pScope, pPath, outcome, hosts);
+	else
+		ResponseCache::getInstance().insert(pScope, pPath, outcome, hosts, FileMappingClient::m_partial_lifetime_seconds);
+	pClient.finished(pScope, pPath);
+
+	{
+		XrdSysCondVarHelper sentry(pCond);
+		pStatus = status;
+		pHosts.swap(hosts);
+		// Do not allow re-ordering of the above assignments
+		// after the below AtomicInc.  If there are no atomics,
+		// everything is protected by a mutex and we can safely
+		// skip the call.
+#ifdef HAVE_ATOMICS
+		__sync_synchronize();
+#endif
+		AtomicInc(pValid);
+		pCond.Broadcast();
+		for (std::vector<std::pair<LocateObserver *, size_t> >::const_iterator it = pWaiters.begin(); it != pWaiters.end(); ++it)
+		{
+			it->first->notify(it->second, pStatus->IsOK());
+		}
+		pWaiters.clear();
+	}
+
+	// Drop the reference held on behalf of XrdCl.
+	Release();
+}
@@ -1,6 +1,9 @@
+#ifndef __XROOTDCLIENT_H_
+#define __XROOTDCLIENT_H_
 
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "classad/classad_distribution.h"
@@ -10,64 +13,321 @@
 #include "XrdSys/XrdSysPthread.hh"
 #include "XrdSys/XrdSysAtomics.hh"
 
+#include "host_table.h"
+#include "locate_backend.h"
+#include "response_cache.h"
+#include "time_utils.h"
+
 namespace ClassadXrootdMapping {
 
 class FileMappingClient;
+class MappedCatalog;
 class FileMappingResponseHandler;
+class LocateObserver;
+class LocateWaiter;
+class DeepLocate;
 
 typedef classad_unordered<std::string, FileMappingClient*> InstanceTable;
+typedef classad_unordered<std::string, FileMappingResponseHandler*> PendingTable;
 
 /*
  *  Manage file mapping
+ *
+ *  There is one client per redirector.  Clients are reference counted:
+ *  callers hold a reference while they use one, and so does every request
+ *  in flight.  A client nobody has referenced for CLASSAD_XROOTD_CLIENT_IDLE
+ *  seconds is closed, along with its connections.
+ *
+ *  Requests are not sent by the threads asking for them: they are queued
+ *  on the client, and its sender thread sends whatever has gathered in
+ *  one batch.  Concurrent evaluations thus share one wakeup and one pass
+ *  over the connections, and none of them blocks in XrdCl.
+ *
+ *  With CLASSAD_XROOTD_DEEP_LOCATE, managers a redirector names are asked
+ *  in turn, down to the data servers; see DeepLocate.
  */
 class FileMappingClient {
 
+friend class FileMappingResponseHandler;
+friend class PrefetchQueue;
+friend class DeepLocate;
+friend class ManagerResponseHandler;
+
 public:
-	static FileMappingClient &getClient(const std::string &hostname);
+	// The caller owns one reference to the client.  Returns NULL only if
+	// there are too many redirectors to intern another.
+	static FileMappingClient *getClient(const std::string &hostname);
+
+	// Only for callers already holding a reference.
+	void Acquire();
+	void Release();
+
+	RedirectorId getRedirector() const { return m_redirector; }
+
+	static size_t getClientCount();
+
+	// The cache scope for answers from a list of redirectors: the single
+	// redirector itself, or else the whole list as one name.
+	static bool getScope(const std::vector<std::string> &hostnames, RedirectorId &scope);
+
+	// Fastest first, by recent response times; ties keep the given order.
+	static void sortByPreference(std::vector<FileMappingClient *> &clients);
+
+	// False while the circuit breaker is open: the redirector has failed
+	// repeatedly and is not worth asking.  Once the open period is over,
+	// one caller at a time is let through to probe it.  A probe that has
+	// not reported back within the locate timeout counts as failed.
+	bool admit();
+
+	bool map(const std::vector<std::string> & filenames, HostSet & output_hosts);
+
+	// Asks the clients in order, moving on to the next one for the files
+	// still unanswered after a share of the budget.  The first good answer
+	// for each file wins; all are cached under `scope`.  With file_hosts,
+	// each file's answer is also merged into its slot there.
+	static bool map(const std::vector<FileMappingClient *> &clients, RedirectorId scope,
+		const std::vector<std::string> & filenames, HostSet & output_hosts,
+		std::vector<HostSet> *file_hosts = NULL);
+
+	// Starts lookups without waiting; the answers only go to the cache.
+	// Returns false if the breaker kept them from being sent.
+	bool prefetch(const std::vector<std::string> & filenames);
+	bool prefetch(RedirectorId scope, const std::vector<std::string> & filenames);
 
-	bool map(const std::vector<std::string> & filenames, std::set<std::string> & output_hosts);
+	// Sends the lookups to the first of the clients that admits them.
+	// Returns false if none did.
+	static bool prefetch(const std::vector<FileMappingClient *> &clients, RedirectorId scope,
+		const std::vector<std::string> & filenames);
+
+	// Answers what it can from the catalog named by CLASSAD_XROOTD_CATALOG,
+	// without asking any redirector.  The files the catalog does not list
+	// go to `misses`; returns false, leaving `misses` alone, without a catalog.
+	// With file_hosts, each file's answer is also merged into its slot there.
+	static bool searchCatalog(const std::vector<std::string> &filenames, HostSet &hosts,
+		std::vector<std::string> &misses, std::vector<HostSet> *file_hosts = NULL);
+	static bool lookupCatalog(const std::string &filename, HostSet &hosts);
+
+	// The backend is not owned by the clients and must outlive them.  Must
+	// be set before the first lookup.
+	static void setBackend(LocateBackend &backend);
 
 private:
-	FileMappingClient(const std::string &hostname);
+	FileMappingClient(const std::string &hostname, RedirectorId redirector);
+	~FileMappingClient();
+
+	FileMappingResponseHandler *locate(RedirectorId scope, const std::string &);
+	void finished(RedirectorId scope, const std::string &);
+	// With `managers`, the managers listed go there rather than into `hosts`.
+	static bool translate(const XrdCl::LocationInfo &, HostSet &, std::vector<std::string> *managers = NULL);
+	static LookupOutcome classify(const XrdCl::XRootDStatus &status, const XrdCl::LocationInfo *info);
+
+	// Folds the time one request took into the running averages, and
+	// feeds the outcome to the circuit breaker.
+	void recordLatency(uint64_t latency_us, bool answered);
+	// A request that missed the map() deadline counts as a failure.
+	void recordMiss();
+	void recordFailure(uint64_t now_ms);
+	// True while the breaker waits on its probe.
+	bool isProbing();
+	unsigned int getLatency();
+
+	// How long map() waits for this redirector: its smoothed response time
+	// plus four deviations, as TCP sets its retransmit timeout.
+	unsigned int getBudget();
+
+	// Waits until `deadline` for a good answer for each file not yet answered.
+	// Returns true if some file is still without one.
+	static bool collect(std::vector<std::vector<FileMappingResponseHandler *> > &attempts,
+		std::vector<bool> &answered, HostSet &hosts, std::vector<HostSet> *file_hosts,
+		LocateWaiter &waiter, uint64_t deadline);
 
-	bool locate(const std::string &, std::set<std::string> &);
+	void send(FileMappingResponseHandler *handler);
+	XrdCl::XRootDStatus sendLocate(const std::string &path, XrdCl::ResponseHandler *handler);
+	void sendLoop();
+	static void *senderThread(void *);
+
+	// Round-robin over the connections to the redirector.
+	XrdCl::FileSystem &getFileSystem();
+
+	static void reapLoop();
+	static void *reaperThread(void *);
+	static void startReaper();
+
+	static const unsigned int m_budget_ms; // Maximum time one map() call may block.
+	static const unsigned int m_min_budget_ms; // Floor for the adaptive budget.
+	static const unsigned int m_partial_lifetime_seconds; // Cache lifetime of partial answers.
+	static const unsigned int m_reap_interval_seconds; // How often idle clients are looked for.
 
-	std::string m_url;
 	std::string m_host;
-	XrdCl::FileSystem m_fs;
+	RedirectorId m_redirector;
+	std::vector<XrdCl::FileSystem *> m_pool; // One per connection to the redirector.
+
+	// Takes a reference, unless the reaper has retired the client.
+	bool tryAcquire();
+
+	int m_refs;
+	bool m_retired; // Idle and no longer in the published table.
+	time_t m_last_used;
+	unsigned int m_next_fs;
+	unsigned int m_latency_us;   // Moving average of response times; failures count as the whole budget.
+	unsigned int m_deviation_us; // Moving average of the samples' distance from it.
+	bool m_measured;             // False until the first sample.
+
+	enum BreakerState {
+		BreakerClosed,
+		BreakerOpen,
+		BreakerHalfOpen // The open period is over; one probe is in flight.
+	};
+	BreakerState m_breaker;
+	unsigned int m_failures;  // Consecutive failures.
+	uint64_t m_open_until_ms; // Monotonic time at which the breaker may let a probe through.
+	uint64_t m_probe_until_ms; // Monotonic time by which the probe must have reported back.
+	XrdSysMutex m_mutex; // Protects the members above.
+
+	PendingTable m_pending; // Outstanding requests, so concurrent lookups share one.
+	XrdSysMutex m_pending_mutex;
+
+	std::vector<FileMappingResponseHandler *> m_submissions; // Requests waiting for the sender.
+	bool m_stopping;
+	XrdSysCondVar m_submit_cond; // Protects the two members above.
+	pthread_t m_sender;
+	bool m_threaded; // False if the sender could not be started; requests are then sent inline.
+
+	static void openCatalog();
+
+	static MappedCatalog *m_catalog; // NULL without one; never replaced.
+	static pthread_once_t m_catalog_once;
+
+	static LocateBackend *m_backend;
+	static XrdClBackend m_xrdcl_backend;
+
+	// Copy-on-write: a published table is never modified, so lookups take
+	// no lock.  The reaper publishes a table without the idle clients and
+	// retires them, so they can no longer be acquired.  They, and the
+	// tables replaced meanwhile, are freed a reap interval later, when no
+	// reader can still be looking at them.
+	static InstanceTable * volatile m_instance_table;
+	static std::vector<InstanceTable *> m_retired_tables; // Replaced since the last reap.
+	static XrdSysMutex m_table_mutex; // Serializes writers.
+	static pthread_once_t m_reaper_once;
+};
+
+/*
+ * Told of the requests for a caller's files as they are sent and as they
+ * complete; see FileMappingResponseHandler::AddWaiter.  notify() is called
+ * with the request's lock held, so it must not call back into the request.
+ */
+class LocateObserver {
+
+public:
+
+	virtual ~LocateObserver() {}
+
+	// A request for file `idx` was sent.
+	virtual void add(size_t idx) = 0;
+
+	virtual void notify(size_t idx, bool answered) = 0;
+};
+
+/*
+ * Tracks the requests one map() call waits on, file by file.  Requests
+ * report their outcome to the waiters registered with them as it arrives,
+ * and the caller is only woken once every file is settled: answered, or
+ * failed by every redirector asked.  map() thus sleeps once per stage
+ * instead of once per file.
+ */
+class LocateWaiter : public LocateObserver {
+
+public:
+
+	LocateWaiter(size_t files) : m_cond(0), m_outstanding(files, 0), m_answered(files, false), m_unsettled(0) {}
+
+	// Every request is counted, even for a file already answered: a hedge
+	// may be sent for a file whose answer arrived after the caller looked.
+	virtual void add(size_t idx)
+	{
+		XrdSysCondVarHelper monitor(m_cond);
+		bool settled = isSettled(idx);
+		m_outstanding[idx]++;
+		if (settled && !isSettled(idx))
+			m_unsettled++;
+	}
+
+	virtual void notify(size_t idx, bool answered)
+	{
+		XrdSysCondVarHelper monitor(m_cond);
+		bool settled = isSettled(idx);
+		m_outstanding[idx]--;
+		m_answered[idx] = m_answered[idx] || answered;
+		if (!settled && isSettled(idx) && !--m_unsettled)
+			m_cond.Signal();
+	}
+
+	// Returns false if some file is still unsettled at the deadline.
+	bool wait(uint64_t deadline)
+	{
+		XrdSysCondVarHelper monitor(m_cond);
+		unsigned int wait_ms;
+		while (m_unsettled && (wait_ms = remaining_ms(deadline)))
+			m_cond.WaitMS(wait_ms);
+		return !m_unsettled;
+	}
 
-	static InstanceTable m_instance_table;
-	static XrdSysMutex m_table_mutex;
+private:
+
+	bool isSettled(size_t idx) const { return m_answered[idx] || !m_outstanding[idx]; }
+
+	XrdSysCondVar m_cond;
+	std::vector<unsigned int> m_outstanding; // Requests in flight, per file.
+	std::vector<bool> m_answered;
+	size_t m_unsettled;
 };
 
 /*
  * Asynchronous handler for the location request.
+ *
+ * The handler is reference counted: XrdCl holds one reference until the
+ * response arrives, and each caller waiting on the request holds another.
+ * Whoever drops the last reference deletes it, so a caller may give up
+ * on a slow redirector without leaking the handler.
  */
 class FileMappingResponseHandler : public XrdCl::ResponseHandler
 {
 
 public:
 
-	FileMappingResponseHandler():
+	FileMappingResponseHandler(FileMappingClient &client, RedirectorId scope, const std::string &path):
 		pStatus(0),
-		pResponse(0),
 		pValid(0),
-		pWaitedOnce(0),
-		pCond(0)
-	{}
+		pRefs(2),
+		pCond(0),
+		pClient(client),
+		pScope(scope),
+		pPath(path),
+		pStart(monotonic_us())
+	{
+		// Keep the client, and its connections, open until we are done.
+		pClient.Acquire();
+	}
 
 	virtual void HandleResponse( XrdCl::XRootDStatus *status, XrdCl::AnyObject *response );
 
+	// The outcome of a deep locate started by this request.  If it only
+	// tried managers from the ManagerCache and found nothing, the
+	// redirector is asked after all.
+	void DeepFinished(XrdCl::XRootDStatus *status, HostSet &hosts, bool complete, LookupOutcome outcome, bool shortcut);
+
 	int WaitForResponseMS(unsigned int waitTime)
 	{
 		XrdSysCondVarHelper sentry(pCond);
 		// We don't call AtomicBeg/End here because the pCond
 		// is always locked.
 		int valid = AtomicGet(pValid);
-		if (valid)
-			return 0;
-		pCond.WaitMS(waitTime);
-        pWaitedOnce = 1;
+		if (!valid && waitTime)
+		{
+			pCond.WaitMS(waitTime);
+			valid = AtomicGet(pValid);
+		}
 		if (!valid)
 			return 1;
 		return 0;
@@ -82,14 +342,11 @@ public:
 		return valid;
 	}
 
-	inline bool GetResponse(XrdCl::LocationInfo &info)
+	inline bool GetHosts(HostSet &hosts)
 	{
 		if (isValid() && pStatus->IsOK())
 		{
-			XrdCl::LocationInfo *linfo = 0;
-			pResponse->Get(linfo);
-			if (!linfo)
-				return false;
+			hosts.merge(pHosts);
 			return true;
 		}
 		return false;
@@ -105,22 +362,75 @@ public:
 		return false;
 	}
 
+	inline void Acquire()
+	{
+		XrdSysCondVarHelper monitor(pCond);
+		pRefs++;
+	}
+
+	// The waiter is told the outcome for its file `idx` when the response
+	// arrives, or at once if it is already in.  Remove it before it goes
+	// away; it may be added more than once, and each add needs a remove.
+	inline void AddWaiter(LocateObserver *waiter, size_t idx)
+	{
+		XrdSysCondVarHelper monitor(pCond);
+		waiter->add(idx);
+		if (AtomicGet(pValid))
+			waiter->notify(idx, pStatus->IsOK());
+		else
+			pWaiters.push_back(std::make_pair(waiter, idx));
+	}
+
+	inline void RemoveWaiter(LocateObserver *waiter)
+	{
+		XrdSysCondVarHelper monitor(pCond);
+		for (std::vector<std::pair<LocateObserver *, size_t> >::iterator it = pWaiters.begin(); it != pWaiters.end(); ++it)
+		{
+			if (it->first == waiter)
+			{
+				pWaiters.erase(it);
+				break;
+			}
+		}
+	}
+
+	const std::string &GetPath() const { return pPath; }
+
+	inline void Release()
+	{
+		int refs;
+		{
+			XrdSysCondVarHelper monitor(pCond);
+			refs = --pRefs;
+		}
+		if (!refs)
+			delete this;
+	}
+
+private:
+
+	void Complete(XrdCl::XRootDStatus *status, HostSet &hosts, bool complete, LookupOutcome outcome);
 
 	virtual ~FileMappingResponseHandler()
 	{
 		XrdSysCondVarHelper monitor(pCond);
 		if (pStatus)
 			delete pStatus;
-		if (pResponse)
-			delete pResponse;
+		pClient.Release();
 	}
 
-private:
 	XrdCl::XRootDStatus  *pStatus;
-	XrdCl::AnyObject     *pResponse;
+	HostSet               pHosts;
 	int                   pValid;
-	int                   pWaitedOnce;
+	int                   pRefs;
 	XrdSysCondVar         pCond;
+	std::vector<std::pair<LocateObserver *, size_t> > pWaiters; // Each with its file's index.
+	FileMappingClient    &pClient;
+	RedirectorId          pScope;
+	std::string           pPath;
+	uint64_t              pStart; // Microseconds.
 };
 
 }
+
+#endif
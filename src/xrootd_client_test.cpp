@@ -0,0 +1,285 @@
+
+#include <cstdlib>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "fake_redirector.h"
+#include "hostname_cache.h"
+#include "stats.h"
+#include "test_utils.h"
+#include "time_utils.h"
+#include "xrootd_client.h"
+
+using namespace ClassadXrootdMapping;
+
+static const unsigned int sites = 4;
+
+static long long getStat(const std::string &name)
+{
+	std::vector<std::pair<std::string, long long> > values;
+	Stats::getInstance().collect(values);
+	for (std::vector<std::pair<std::string, long long> >::const_iterator it = values.begin(); it != values.end(); ++it)
+	{
+		if (it->first == name)
+			return it->second;
+	}
+	return -1;
+}
+
+static std::vector<std::string> make_files(const std::string &prefix, unsigned int count)
+{
+	std::vector<std::string> files;
+	for (unsigned int idx = 0; idx < count; idx++)
+	{
+		std::stringstream filename;
+		filename << "/store/" << prefix << "/file" << idx << ".root";
+		files.push_back(filename.str());
+	}
+	return files;
+}
+
+// Resolves the fake sites up front, so no answer is left partial by DNS.
+static void resolve_sites()
+{
+	HostnameCache &cache = HostnameCache::getInstance();
+	for (unsigned int site = 0; site < sites; site++)
+	{
+		std::stringstream address;
+		address << "127.0.0." << site << ":1094";
+		std::string hostname;
+		uint64_t deadline = monotonic_ms() + 5000;
+		while (cache.lookup(address.str(), hostname) == HostnameCache::Pending && remaining_ms(deadline))
+		{
+			sleep_us(1000);
+		}
+	}
+}
+
+/*
+ * A file is settled once answered, or once every request for it has
+ * failed; requests sent after the answer must not unsettle it.
+ */
+static void test_waiter()
+{
+	LocateWaiter waiter(2);
+	check(waiter.wait(monotonic_ms()), "nothing sent is settled");
+
+	waiter.add(0);
+	waiter.add(1);
+	check(!waiter.wait(monotonic_ms() + 5), "sent files are unsettled");
+
+	// File 0 is answered, then hedged anyway; file 1 fails.
+	waiter.notify(0, true);
+	waiter.add(0);
+	waiter.notify(1, false);
+	check(waiter.wait(monotonic_ms()), "answered and failed files are settled");
+
+	// The hedge's late failure changes nothing; a hedge for file 1 reopens it.
+	waiter.notify(0, false);
+	check(waiter.wait(monotonic_ms()), "late failure after an answer");
+	waiter.add(1);
+	check(!waiter.wait(monotonic_ms() + 5), "hedged failed file is unsettled");
+	waiter.notify(1, true);
+	check(waiter.wait(monotonic_ms()), "hedge answered");
+}
+
+/*
+ * A redirector that has not answered by the hedge point is raced by the
+ * next one, and the call returns with the second one's answers well
+ * before the budget is up.
+ */
+static void test_hedge(FakeRedirector &fake)
+{
+	fake.setLatency("slow.example", 500000);
+	fake.setLatency("fast.example", 1000);
+
+	std::vector<std::string> names;
+	names.push_back("slow.example");
+	names.push_back("fast.example");
+	RedirectorId scope;
+	check(FileMappingClient::getScope(names, scope), "scope for the redirector list");
+	std::vector<FileMappingClient *> clients;
+	for (std::vector<std::string>::const_iterator it = names.begin(); it != names.end(); ++it)
+	{
+		clients.push_back(FileMappingClient::getClient(*it));
+	}
+
+	std::vector<std::string> files = make_files("hedge", 5);
+	long long hedges = getStat("Hedges");
+	HostSet hosts;
+	uint64_t start = monotonic_ms();
+	check(FileMappingClient::map(clients, scope, files, hosts), "hedged map");
+	uint64_t elapsed = monotonic_ms() - start;
+	checkEqual(getStat("Hedges"), hedges + 1, "hedges");
+	check(elapsed < 45, "hedged map returns before the budget");
+
+	HostSet expected;
+	check(clients[1]->map(files, expected), "map at the fast redirector alone");
+	check(!expected.empty(), "files found");
+	check(hosts == expected, "hedged answer is the fast redirector's");
+
+	for (std::vector<FileMappingClient *>::const_iterator it = clients.begin(); it != clients.end(); ++it)
+	{
+		(*it)->Release();
+	}
+}
+
+/*
+ * A redirector that fails every file at once is hedged right away rather
+ * than at the hedge point.
+ */
+static void test_hedge_failed(FakeRedirector &fake)
+{
+	fake.setDown("down.example", true);
+	fake.setLatency("backup.example", 1000);
+
+	std::vector<std::string> names;
+	names.push_back("down.example");
+	names.push_back("backup.example");
+	RedirectorId scope;
+	check(FileMappingClient::getScope(names, scope), "scope for the redirector list");
+	std::vector<FileMappingClient *> clients;
+	for (std::vector<std::string>::const_iterator it = names.begin(); it != names.end(); ++it)
+	{
+		clients.push_back(FileMappingClient::getClient(*it));
+	}
+
+	std::vector<std::string> files = make_files("failed", 5);
+	HostSet hosts;
+	uint64_t start = monotonic_ms();
+	check(FileMappingClient::map(clients, scope, files, hosts), "map past a failed redirector");
+	uint64_t elapsed = monotonic_ms() - start;
+	check(!hosts.empty(), "answered by the second redirector");
+	check(elapsed < 25, "second redirector asked before the hedge point");
+
+	for (std::vector<FileMappingClient *>::const_iterator it = clients.begin(); it != clients.end(); ++it)
+	{
+		(*it)->Release();
+	}
+}
+
+// One lookup of one file; the breaker counts it as one success or failure.
+static void map_one(FileMappingClient &client, const std::string &prefix, unsigned int idx)
+{
+	std::vector<std::string> files = make_files(prefix, idx + 1);
+	HostSet hosts;
+	client.map(std::vector<std::string>(1, files[idx]), hosts);
+}
+
+/*
+ * Failures open the breaker; after the open period, one probe is let
+ * through, and its answer closes the breaker again.
+ */
+static void test_breaker_recovery(FakeRedirector &fake)
+{
+	FileMappingClient *client = FileMappingClient::getClient("flaky.example");
+	fake.setDown("flaky.example", true);
+
+	long long opens = getStat("BreakerOpens");
+	map_one(*client, "flaky", 0);
+	check(client->admit(), "closed after one failure");
+	map_one(*client, "flaky", 1);
+	checkEqual(getStat("BreakerOpens"), opens + 1, "breaker opens");
+	check(!client->admit(), "open after two failures");
+
+	sleep_us(1100000);
+	fake.setDown("flaky.example", false);
+	map_one(*client, "flaky", 2);
+	check(client->admit(), "closed by an answered probe");
+	check(client->admit(), "closed breaker admits everyone");
+
+	client->Release();
+}
+
+/*
+ * A probe that fails reopens the breaker at once; one that never reports
+ * back does once the locate timeout has passed.
+ */
+static void test_breaker_probe(FakeRedirector &fake)
+{
+	FileMappingClient *client = FileMappingClient::getClient("dead.example");
+	fake.setDown("dead.example", true);
+	map_one(*client, "dead", 0);
+	map_one(*client, "dead", 1);
+	check(!client->admit(), "open after two failures");
+
+	// A failed probe.
+	sleep_us(1100000);
+	long long opens = getStat("BreakerOpens");
+	map_one(*client, "dead", 2);
+	checkEqual(getStat("BreakerOpens"), opens + 1, "breaker reopened by the failed probe");
+	check(!client->admit(), "open after a failed probe");
+
+	// A probe that is let through but never sent, as if lost.
+	sleep_us(1100000);
+	check(client->admit(), "probe admitted");
+	check(!client->admit(), "one probe at a time");
+	sleep_us(1100000);
+	check(!client->admit(), "lost probe reopens the breaker");
+	checkEqual(getStat("BreakerOpens"), opens + 2, "breaker reopened by the lost probe");
+	sleep_us(1100000);
+	check(client->admit(), "next probe admitted after the open period");
+
+	client->Release();
+}
+
+/*
+ * The breaker's probe goes to the redirector itself even where managers
+ * for the file's directory are remembered, so its answer closes the
+ * breaker.
+ */
+static void test_breaker_shortcut(FakeRedirector &fake)
+{
+	FileMappingClient *client = FileMappingClient::getClient("deep.example");
+
+	// A deep locate remembers the managers for the directory.
+	map_one(*client, "deep", 0);
+	long long shortcuts = getStat("ManagerCacheHits");
+	map_one(*client, "deep", 1);
+	checkEqual(getStat("ManagerCacheHits"), shortcuts + 1, "remembered managers asked");
+
+	// Open the breaker with lookups in another directory.
+	fake.setDown("deep.example", true);
+	map_one(*client, "deep-down", 0);
+	map_one(*client, "deep-down", 1);
+	check(!client->admit(), "open after two failures");
+
+	sleep_us(1100000);
+	fake.setDown("deep.example", false);
+	shortcuts = getStat("ManagerCacheHits");
+	map_one(*client, "deep", 2);
+	checkEqual(getStat("ManagerCacheHits"), shortcuts, "probe skips the remembered managers");
+	check(client->admit(), "closed by the probe");
+
+	client->Release();
+}
+
+int main() {
+
+	// The hedge point at 60% of the 50 ms budget, well clear of a failure
+	// answered at once; breakers that open and time out their probes fast;
+	// redirectors that name managers, which are asked in turn.
+	setenv("CLASSAD_XROOTD_HEDGE_PERCENT", "60", 1);
+	setenv("CLASSAD_XROOTD_BREAKER_FAILURES", "2", 1);
+	setenv("CLASSAD_XROOTD_BREAKER_OPEN", "1", 1);
+	setenv("CLASSAD_XROOTD_LOCATE_TIMEOUT", "1", 1);
+	setenv("CLASSAD_XROOTD_DEEP_LOCATE", "1", 1);
+
+	FakeRedirector *fake = new FakeRedirector(1000, 0, 0, sites, 2, 2);
+	FakeResolver resolver;
+	FileMappingClient::setBackend(*fake);
+	HostnameCache::getInstance().setResolver(resolver);
+	resolve_sites();
+
+	test_waiter();
+	test_hedge(*fake);
+	test_hedge_failed(*fake);
+	test_breaker_recovery(*fake);
+	test_breaker_probe(*fake);
+	test_breaker_shortcut(*fake);
+
+	// The fake's reply threads outlive main(); it is never deleted.
+	return finishTests("client");
+}
@@ -20,21 +20,35 @@
 #include <vector>
 #include <string>
 #include <sstream>
+#include <fstream>
+#include <cstring>
+#include <strings.h>
 
 #include "classad/classad_distribution.h"
 #include "classad/classad_stl.h"
 #include "classad/fnCall.h"
 
 #include "xrootd_client.h"
+#include "hostname_cache.h"
 #include "response_cache.h"
+#include "prefetch_queue.h"
+#include "result_memo.h"
+#include "stats.h"
+#include "time_utils.h"
 
 using namespace classad;
 using namespace ClassadXrootdMapping;
 
 static bool files_to_sites(const char *name, ArgumentList const &arguments,
     EvalState &state, Value  &result);
-
-static ResponseTable response_cache;
+static bool files_coverage_by_site(const char *name, ArgumentList const &arguments,
+    EvalState &state, Value  &result);
+static bool file_available_at(const char *name, ArgumentList const &arguments,
+    EvalState &state, Value  &result);
+static bool prefetch_files_to_sites(const char *name, ArgumentList const &arguments,
+    EvalState &state, Value  &result);
+static bool xrootd_mapping_stats(const char *name, ArgumentList const &arguments,
+    EvalState &state, Value  &result);
 
 /***************************************************************************
  *
@@ -52,6 +66,14 @@ static ClassAdFunctionMapping functions[] =
 {
     { "filesToSites", (void *) files_to_sites, 0 },
     { "files_to_sites", (void *) files_to_sites, 0 },
+    { "filesCoverageBySite", (void *) files_coverage_by_site, 0 },
+    { "files_coverage_by_site", (void *) files_coverage_by_site, 0 },
+    { "fileAvailableAt", (void *) file_available_at, 0 },
+    { "file_available_at", (void *) file_available_at, 0 },
+    { "prefetchFilesToSites", (void *) prefetch_files_to_sites, 0 },
+    { "prefetch_files_to_sites", (void *) prefetch_files_to_sites, 0 },
+    { "xrootdMappingStats", (void *) xrootd_mapping_stats, 0 },
+    { "xrootd_mapping_stats", (void *) xrootd_mapping_stats, 0 },
     { "",            NULL,                 0 }
 };
 
@@ -66,8 +88,41 @@ extern "C"
 {
 	ClassAdFunctionMapping *Init(void)
 	{
+		// Set up the cache now, mapping any snapshot left by a prior run,
+		// so the first evaluations are already served from it.
+		ResponseCache::getInstance();
+		Stats::getInstance();
 		return functions;
 	}
+
+	/*
+	 * Warms the cache from a file with one filename per line, e.g. the
+	 * inputs of a batch of jobs about to be submitted.  Returns the number
+	 * of files queued, or -1 if the file could not be read.
+	 */
+	long classad_xrootd_mapping_prefetch(const char *xrootd_host, const char *path)
+	{
+		if (!xrootd_host || !path)
+			return -1;
+		std::ifstream input(path);
+		if (!input)
+			return -1;
+		return PrefetchQueue::getInstance().enqueue(xrootd_host, input, PrefetchLow);
+	}
+
+	/*
+	 * Replaces XrdCl and DNS with the given backend and resolver, e.g. the
+	 * fakes of classad_xrootd_mapping_bench.  Either may be NULL to keep
+	 * the current one.  Both must outlive the module, and must be installed
+	 * before the first lookup.
+	 */
+	void classad_xrootd_mapping_set_backend(LocateBackend *backend, HostnameResolver *resolver)
+	{
+		if (backend)
+			FileMappingClient::setBackend(*backend);
+		if (resolver)
+			HostnameCache::getInstance().setResolver(*resolver);
+	}
 }
 
 
@@ -104,87 +159,668 @@ static bool convert_to_vector_string(EvalState & state, Value & arg, std::vector
 
 }
 
+/****************************************************************************
+ *
+ * Evaluate the (hostnames, filenames) arguments shared by the functions
+ * below.  Each may be a single string or a list of strings.  Functions
+ * taking more arguments check the count themselves and pass the most they
+ * take.  On failure, CondorErrMsg says why.
+ *
+ ****************************************************************************/
+static bool parse_arguments(
+	const char         *name,
+	const ArgumentList &arguments,
+	EvalState          & state,
+	std::vector<std::string> &xrootd_hosts,
+	std::vector<std::string> &filenames,
+	size_t             max_arguments = 2)
+{
+	Value xrootd_host_arg, filenames_arg;
+
+	if (arguments.size() < 2 || arguments.size() > max_arguments) {
+		CondorErrMsg = std::string("Invalid number of arguments passed to ") + name + "; 2 required.";
+		return false;
+	}
+
+	std::string xrootd_host;
+	if (!arguments[0]->Evaluate(state, xrootd_host_arg)) {
+		CondorErrMsg = std::string("Could not evaluate the first argument (Xrootd hostnames) of ") + name + ".";
+		return false;
+	}
+	if (xrootd_host_arg.IsStringValue(xrootd_host))
+	{
+		xrootd_hosts.push_back(xrootd_host);
+	}
+	else if (!convert_to_vector_string(state, xrootd_host_arg, xrootd_hosts) || xrootd_hosts.empty())
+	{
+		CondorErrMsg = std::string("Could not evaluate the first argument (Xrootd hostnames) of ") + name + " to a string or a non-empty list of strings.";
+		return false;
+	}
+
+	if (!arguments[1]->Evaluate(state, filenames_arg)) {
+		CondorErrMsg = std::string("Could not evaluate the second argument (list of filenames) of ") + name + ".";
+		return false;
+	}
+	std::string single_filename;
+	if (filenames_arg.IsStringValue(single_filename))
+	{
+		filenames.push_back(single_filename);
+	}
+	else if (!convert_to_vector_string(state, filenames_arg, filenames))
+	{
+		CondorErrMsg = std::string("Could not evaluate the second argument (list of filenames) of ") + name + " to a list of strings.";
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * The (hostnames, filenames) arguments as hash_arguments() evaluated them,
+ * with the elements of any list, so a memo miss need not evaluate them
+ * again.
+ */
+struct EvaluatedArguments {
+	Value m_values[2];
+	std::vector<Value> m_elements[2];
+};
+
+/****************************************************************************
+ *
+ * Hash the (hostnames, filenames) arguments, in order, for the result memo.
+ * Strings are hashed where they are, without copying them out, and the
+ * evaluated values are kept in `evaluated`.  Returns false if the arguments
+ * are not ones parse_arguments() would accept.
+ *
+ ****************************************************************************/
+static bool hash_arguments(
+	const ArgumentList &arguments,
+	EvalState          & state,
+	EvaluatedArguments &evaluated,
+	MemoKey            &key)
+{
+	if (arguments.size() != 2)
+		return false;
+
+	for (size_t idx = 0; idx < 2; idx++)
+	{
+		Value &val = evaluated.m_values[idx];
+		if (!arguments[idx] || !arguments[idx]->Evaluate(state, val))
+			return false;
+
+		const char *string_value;
+		ExprList *list_ptr = NULL;
+		if (val.IsStringValue(string_value))
+		{
+			key.add(string_value, strlen(string_value));
+		}
+		// Like parse_arguments(), take no empty list of redirectors.
+		else if (val.IsListValue(list_ptr) && list_ptr && (idx || list_ptr->size()))
+		{
+			std::vector<Value> &elements = evaluated.m_elements[idx];
+			elements.resize(list_ptr->size());
+			std::vector<Value>::iterator element = elements.begin();
+			for (ExprList::const_iterator it = list_ptr->begin(); it != list_ptr->end(); ++it, ++element)
+			{
+				const ExprTree * tree = *it;
+				if (!tree || !tree->Evaluate(state, *element) || !element->IsStringValue(string_value))
+					return false;
+				key.add(string_value, strlen(string_value));
+			}
+		}
+		else
+		{
+			return false;
+		}
+		key.separate();
+	}
+	key.finish();
+	return true;
+}
+
+/****************************************************************************
+ *
+ * Copy out the strings of arguments hash_arguments() accepted.
+ *
+ ****************************************************************************/
+static void convert_arguments(
+	const EvaluatedArguments &evaluated,
+	std::vector<std::string> &xrootd_hosts,
+	std::vector<std::string> &filenames)
+{
+	std::vector<std::string> *outputs[2] = { &xrootd_hosts, &filenames };
+	for (size_t idx = 0; idx < 2; idx++)
+	{
+		std::string string_value;
+		if (evaluated.m_values[idx].IsStringValue(string_value))
+		{
+			outputs[idx]->push_back(string_value);
+			continue;
+		}
+		const std::vector<Value> &elements = evaluated.m_elements[idx];
+		outputs[idx]->reserve(elements.size());
+		for (std::vector<Value>::const_iterator it = elements.begin(); it != elements.end(); ++it)
+		{
+			it->IsStringValue(string_value);
+			outputs[idx]->push_back(string_value);
+		}
+	}
+}
+
+/****************************************************************************
+ *
+ * Take a reference to the client for each redirector, fastest first.
+ *
+ ****************************************************************************/
+static void release_clients(std::vector<FileMappingClient *> &clients);
+
+static bool get_clients(const char *name, const std::vector<std::string> &xrootd_hosts, std::vector<FileMappingClient *> &clients)
+{
+	clients.reserve(xrootd_hosts.size());
+	for (std::vector<std::string>::const_iterator it = xrootd_hosts.begin(); it != xrootd_hosts.end(); ++it)
+	{
+		FileMappingClient *client = FileMappingClient::getClient(*it);
+		if (!client)
+		{
+			release_clients(clients);
+			CondorErrMsg = std::string("Too many distinct Xrootd hostnames passed to ") + name + ".";
+			return false;
+		}
+		clients.push_back(client);
+	}
+	FileMappingClient::sortByPreference(clients);
+	return true;
+}
+
+static void release_clients(std::vector<FileMappingClient *> &clients)
+{
+	for (std::vector<FileMappingClient *>::const_iterator it = clients.begin(); it != clients.end(); ++it)
+	{
+		(*it)->Release();
+	}
+	clients.clear();
+}
+
+/*
+ * Each file's own answer, for callers that need more than the union.
+ * Every stage of lookup_files answers some of the files it is given and
+ * passes the rest on in the same order; the stage's per-file answers are
+ * merged into the caller's slot for each file.
+ */
+class FileAnswers {
+
+public:
+
+	FileAnswers(std::vector<HostSet> *file_hosts, size_t count) : m_file_hosts(file_hosts)
+	{
+		if (!m_file_hosts)
+			return;
+		m_file_hosts->assign(count, HostSet());
+		for (size_t idx = 0; idx < count; idx++)
+		{
+			m_positions.push_back(idx);
+		}
+	}
+
+	// Per-file answers for the next stage, sized like its files; NULL if
+	// the caller wants none.
+	std::vector<HostSet> *stage()
+	{
+		if (!m_file_hosts)
+			return NULL;
+		m_stage.assign(m_positions.size(), HostSet());
+		return &m_stage;
+	}
+
+	// Takes the stage's answers; `remaining` are the files it passed on.
+	void merge(const std::vector<std::string> &stage_files, const std::vector<std::string> &remaining)
+	{
+		if (!m_file_hosts)
+			return;
+		std::vector<size_t> next;
+		next.reserve(remaining.size());
+		for (size_t idx = 0; idx < stage_files.size(); idx++)
+		{
+			(*m_file_hosts)[m_positions[idx]].merge(m_stage[idx]);
+			if (next.size() < remaining.size() && remaining[next.size()] == stage_files[idx])
+				next.push_back(m_positions[idx]);
+		}
+		m_positions.swap(next);
+	}
+
+private:
+
+	std::vector<HostSet> *m_file_hosts;
+	// The caller's slot for each file the next stage is given.
+	std::vector<size_t> m_positions;
+	std::vector<HostSet> m_stage;
+};
+
+/****************************************************************************
+ *
+ * Add the hosts of the given files, from the catalog, the cache, or the
+ * redirectors, in that order.  Consumes `filenames`.  If given,
+ * `footprint` records the cached answers used; it is incomplete if any
+ * file needed a redirector.  If given, `file_hosts` is filled with each
+ * file's own hosts, guesses included, in the order of `filenames`.
+ *
+ ****************************************************************************/
+static bool lookup_files(
+	const char                     *name,
+	const std::vector<std::string> &xrootd_hosts,
+	RedirectorId                   scope,
+	std::vector<std::string>       &filenames,
+	HostSet                        &hosts,
+	CacheFootprint                 *footprint = NULL,
+	std::vector<HostSet>           *file_hosts = NULL)
+{
+	FileAnswers answers(file_hosts, filenames.size());
+
+	// Files in the catalog need neither the cache nor a redirector.
+	std::vector<std::string> uncatalogued;
+	if (FileMappingClient::searchCatalog(filenames, hosts, uncatalogued, answers.stage()))
+	{
+		answers.merge(filenames, uncatalogued);
+		filenames.swap(uncatalogued);
+	}
+
+	std::vector<std::string> files_to_query, files_to_refresh;
+	ResponseCache &cache = ResponseCache::getInstance();
+	cache.query(scope, filenames, hosts, files_to_query, files_to_refresh, footprint, answers.stage());
+	answers.merge(filenames, files_to_query);
+
+	if (files_to_query.size() > 0 || files_to_refresh.size() > 0)
+	{
+		std::vector<FileMappingClient *> clients;
+		if (!get_clients(name, xrootd_hosts, clients))
+			return false;
+
+		// Expired answers were used as they are; refresh them in the
+		// background.  If no redirector takes the refresh, a later lookup
+		// must be free to try again.
+		if (!FileMappingClient::prefetch(clients, scope, files_to_refresh))
+			cache.abandonRefresh(scope, files_to_refresh);
+
+		// Files next to ones we know get a provisional answer from their
+		// directory; their own lookups finish in the background.
+		std::vector<std::string> files_guessed;
+		std::vector<std::string> files_unguessed;
+		if (file_hosts)
+			files_unguessed = files_to_query;
+		cache.guess(scope, files_to_query, hosts, files_guessed, answers.stage());
+		answers.merge(files_unguessed, files_to_query);
+		FileMappingClient::prefetch(clients, scope, files_guessed);
+
+		bool mapped = FileMappingClient::map(clients, scope, files_to_query, hosts, answers.stage());
+		answers.merge(files_to_query, std::vector<std::string>());
+		release_clients(clients);
+		if (!mapped) {
+			CondorErrMsg = "Error while mapping the files to hosts.";
+			return false;
+		}
+	}
+	return true;
+}
+
 /****************************************************************************
  *
  * Query an xrootd server and translate filenames to locations
  * To use:
  *  files_to_sites("xrootd.example.com", ["file1", "file2", "file3"])
+ *  files_to_sites({"regional.example.com", "global.example.com"}, ["file1"])
+ *
+ * Given several redirectors, the one answering fastest lately is asked
+ * first; if it has not found a file within a quarter of the budget, the
+ * next one is asked too, and the first to find the file wins.
  *
  * This function will aggressively cache the results (matchmaking will call
  * it many times over a short period); it is also guaranteed to return within
- * 50ms.
+ * 50ms.  Against a redirector that usually answers faster, it waits only as
+ * long as that redirector's recent response times warrant.
  *
  * Returns the list of xrootd endpoints which claim to have the file.  Any not
  * responding or not in the cache after 50ms will be left off the list.  It is
  * not possible to distinguish, in this function, the difference between
  * timeouts, failures, and empty responses.
  *
+ * Repeated calls with the same arguments are answered whole from the
+ * result memo while every cached answer behind the result still holds.
+ *
  ****************************************************************************/
-static bool files_to_sites(
-	const char         *, // name
+static bool map_files_to_sites(
+	const char         *name,
 	const ArgumentList &arguments,
 	EvalState          & state,
 	Value              &result)
 {
-	Value xrootd_host_arg, filenames_arg;
+	// The result shares the list with the cache's response table and the memo.
+	classad_shared_ptr<ExprList> result_list;
+	ResultMemo &memo = ResultMemo::getInstance();
+	MemoKey key;
+	EvaluatedArguments evaluated;
+	bool memoizable = memo.enabled() && hash_arguments(arguments, state, evaluated, key);
+	if (memoizable && memo.find(key, result_list)) {
+		result.SetListValue(result_list);
+		return true;
+	}
 
-	// We check to make sure that we are passed exactly one argument,
-	// then we have to evaluate that argument.
-	if (arguments.size() != 2) {
+	// Without the memo, or for arguments it could not hash, evaluate them
+	// the long way, which also says what is wrong with them.
+	std::vector<std::string> xrootd_hosts;
+	std::vector<std::string> filenames;
+	if (memoizable) {
+		convert_arguments(evaluated, xrootd_hosts, filenames);
+	} else if (!parse_arguments(name, arguments, state, xrootd_hosts, filenames)) {
 		result.SetErrorValue();
-		CondorErrMsg = "Invalid number of arguments passed to files_to_sites; 2 required.";
 		return false;
 	}
 
-	std::string xrootd_host;
-	if (!arguments[0]->Evaluate(state, xrootd_host_arg) || (!xrootd_host_arg.IsStringValue(xrootd_host))) {
+	// A list of redirectors shares one set of answers.
+	RedirectorId scope;
+	if (!FileMappingClient::getScope(xrootd_hosts, scope)) {
 		result.SetErrorValue();
-		CondorErrMsg = "Could not evaluate the first argument (Xrootd hostname) of files_to_sites to a string.";
+		CondorErrMsg = std::string("Too many distinct Xrootd hostnames passed to ") + name + ".";
 		return false;
 	}
 
-	
-	if (!arguments[1]->Evaluate(state, filenames_arg)) {
+	// Taken before the query, so a change racing with it invalidates the memo entry.
+	ResponseCache &cache = ResponseCache::getInstance();
+	uint64_t stamp = cache.getStamp();
+	CacheFootprint footprint;
+
+	HostSet hosts;
+	if (!lookup_files(name, xrootd_hosts, scope, filenames, hosts, memoizable ? &footprint : NULL)) {
 		result.SetErrorValue();
-		CondorErrMsg = "Could not evaluate the second argument (list of filenames) of files_to_sites.";
 		return false;
 	}
+
+	result_list = cache.getList(hosts);
+	result.SetListValue(result_list);
+
+	if (memoizable)
+		memo.insert(key, stamp, footprint, result_list);
+
+	return true;
+}
+
+static bool files_to_sites(
+	const char         *name,
+	const ArgumentList &arguments,
+	EvalState          & state,
+	Value              &result)
+{
+	uint64_t start_us = monotonic_us();
+	bool ok = map_files_to_sites(name, arguments, state, result);
+
+	Stats &stats = Stats::getInstance();
+	stats.record(StatCallLatency, monotonic_us() - start_us);
+	stats.inc(StatCalls);
+	if (!ok)
+		stats.inc(StatCallErrors);
+	return ok;
+}
+
+
+/****************************************************************************
+ *
+ * Work out how much of a set of files each site holds.
+ * To use:
+ *  files_coverage_by_site("xrootd.example.com", ["file1", "file2"])
+ *
+ * The arguments, caching and time limit are as for files_to_sites.
+ *
+ * Returns a ClassAd mapping each host holding any of the files to the
+ * fraction of them it holds, e.g. [ "xrootd.t2.ucsd.edu" = 0.5 ].  Sites
+ * holding none are left out.  This replaces counting over files_to_sites
+ * with ClassAd list operations in RANK expressions: the counts are taken
+ * over the interned host IDs, in one pass over the files.
+ *
+ ****************************************************************************/
+static bool files_coverage_by_site(
+	const char         *name,
+	const ArgumentList &arguments,
+	EvalState          & state,
+	Value              &result)
+{
+	std::vector<std::string> xrootd_hosts;
 	std::vector<std::string> filenames;
-	std::string single_filename;
-	if (filenames_arg.IsStringValue(single_filename))
+	if (!parse_arguments(name, arguments, state, xrootd_hosts, filenames)) {
+		result.SetErrorValue();
+		return false;
+	}
+
+	RedirectorId scope;
+	if (!FileMappingClient::getScope(xrootd_hosts, scope)) {
+		result.SetErrorValue();
+		CondorErrMsg = std::string("Too many distinct Xrootd hostnames passed to ") + name + ".";
+		return false;
+	}
+
+	// Get every file answered, or cached for next time, as files_to_sites
+	// would, keeping each file's own hosts.
+	HostSet hosts;
+	std::vector<HostSet> file_hosts;
+	if (!lookup_files(name, xrootd_hosts, scope, filenames, hosts, NULL, &file_hosts)) {
+		result.SetErrorValue();
+		return false;
+	}
+
+	// Then count, per host ID, the files each host holds.
+	std::vector<unsigned int> counts;
+	for (std::vector<HostSet>::const_iterator it = file_hosts.begin(); it != file_hosts.end(); ++it)
 	{
-		filenames.push_back(single_filename);
+		const std::vector<uint64_t> &words = it->getWords();
+		if (counts.size() < words.size()*64)
+			counts.resize(words.size()*64, 0);
+		for (size_t word = 0; word < words.size(); word++)
+		{
+			for (uint64_t bits = words[word]; bits; bits &= bits - 1)
+			{
+				counts[word*64 + __builtin_ctzll(bits)]++;
+			}
+		}
 	}
-	else if (!convert_to_vector_string(state, filenames_arg, filenames))
+
+	// Coverage differs from job to job, so each result gets its own ad
+	// and owns it.
+	HostTable &host_table = HostTable::getInstance();
+	classad_shared_ptr<ClassAd> coverage(new ClassAd());
+	for (size_t id = 0; id < counts.size(); id++)
 	{
+		if (counts[id])
+			coverage->InsertAttr(host_table.getName(static_cast<HostId>(id)),
+				static_cast<double>(counts[id]) / file_hosts.size());
+	}
+	result.SetClassAdValue(coverage);
+	return true;
+}
+
+
+/****************************************************************************
+ *
+ * Test whether a site holds the given files.
+ * To use:
+ *  file_available_at("xrootd.example.com", ["file1", "file2"], "srm.unl.edu")
+ *  file_available_at("xrootd.example.com", ["file1", "file2"], TARGET.Machine, "all")
+ *
+ * The first two arguments, caching and time limit are as for files_to_sites.
+ * With "any", the default, this is true if the site holds at least one of
+ * the files, like member(site, files_to_sites(...)); with "all", only if it
+ * holds every one of them.
+ *
+ * Meant for Requirements expressions, evaluated once per slot per job: the
+ * answer is a lookup of the site's host ID in the cached host sets, and no
+ * list is built or scanned.
+ *
+ ****************************************************************************/
+static bool file_available_at(
+	const char         *name,
+	const ArgumentList &arguments,
+	EvalState          & state,
+	Value              &result)
+{
+	if (arguments.size() != 3 && arguments.size() != 4) {
 		result.SetErrorValue();
-		CondorErrMsg = "Could not evaluate the second argument (list of filenames) of files_to_sites to a list of strings.";
+		CondorErrMsg = std::string("Invalid number of arguments passed to ") + name + "; 3 or 4 required.";
 		return false;
 	}
 
-	std::vector<std::string> files_to_query;
-	ResponseCache &cache = ResponseCache::getInstance();
-	classad_shared_ptr<ExprList> result_list = cache.query(filenames, files_to_query);
+	std::vector<std::string> xrootd_hosts;
+	std::vector<std::string> filenames;
+	if (!parse_arguments(name, arguments, state, xrootd_hosts, filenames, 4)) {
+		result.SetErrorValue();
+		return false;
+	}
 
-	if (files_to_query.size() > 0)
-	{
-		FileMappingClient &client = FileMappingClient::getClient(xrootd_host);
+	Value site_arg;
+	std::string site;
+	if (!arguments[2]->Evaluate(state, site_arg) || !site_arg.IsStringValue(site)) {
+		result.SetErrorValue();
+		CondorErrMsg = std::string("Could not evaluate the third argument (site) of ") + name + " to a string.";
+		return false;
+	}
 
-		std::set<std::string> hosts;
-		if (!client.map(filenames, hosts)) {
+	bool require_all = false;
+	if (arguments.size() == 4)
+	{
+		Value mode_arg;
+		std::string mode;
+		if (!arguments[3]->Evaluate(state, mode_arg) || !mode_arg.IsStringValue(mode) ||
+			(strcasecmp(mode.c_str(), "all") && strcasecmp(mode.c_str(), "any")))
+		{
 			result.SetErrorValue();
-			CondorErrMsg = "Error while mapping the files to hosts.";
+			CondorErrMsg = std::string("The fourth argument (mode) of ") + name + " must be \"all\" or \"any\".";
 			return false;
 		}
+		require_all = !strcasecmp(mode.c_str(), "all");
+	}
+
+	RedirectorId scope;
+	if (!FileMappingClient::getScope(xrootd_hosts, scope)) {
+		result.SetErrorValue();
+		CondorErrMsg = std::string("Too many distinct Xrootd hostnames passed to ") + name + ".";
+		return false;
+	}
+
+	// "all" needs each file's own hosts; "any" only their union.
+	HostSet hosts;
+	bool all_files = require_all && !filenames.empty();
+	std::vector<HostSet> file_hosts;
+	if (!lookup_files(name, xrootd_hosts, scope, filenames, hosts, NULL, all_files ? &file_hosts : NULL)) {
+		result.SetErrorValue();
+		return false;
+	}
 
-		if (hosts.size() > 0)
+	// A site no answer has ever named has no ID, and holds none of the files.
+	// The union of the answers settles "any", and rules out most sites for "all".
+	HostId site_id;
+	bool known = HostTable::getInstance().find(site, site_id) && hosts.contains(site_id);
+	if (!all_files || !known)
+	{
+		result.SetBooleanValue(require_all ? (known || !all_files) : known);
+		return true;
+	}
+
+	bool available = true;
+	for (std::vector<HostSet>::const_iterator it = file_hosts.begin(); available && it != file_hosts.end(); ++it)
+	{
+		available = it->contains(site_id);
+	}
+	result.SetBooleanValue(available);
+	return true;
+}
+
+
+/****************************************************************************
+ *
+ * Warm the cache ahead of matchmaking.
+ * To use:
+ *  prefetch_files_to_sites("xrootd.example.com", ["file1", "file2", "file3"])
+ *
+ * Queues lookups for the files not yet cached and returns immediately; the
+ * answers only go to the cache, for later files_to_sites calls to find.
+ * These requests go ahead of bulk prefetches from files.
+ *
+ * Returns true if every file was queued, false if the queue was full.
+ *
+ ****************************************************************************/
+static bool prefetch_files_to_sites(
+	const char         *name,
+	const ArgumentList &arguments,
+	EvalState          & state,
+	Value              &result)
+{
+	std::vector<std::string> xrootd_hosts;
+	std::vector<std::string> filenames;
+	if (!parse_arguments(name, arguments, state, xrootd_hosts, filenames)) {
+		result.SetErrorValue();
+		return false;
+	}
+
+	RedirectorId scope;
+	if (!FileMappingClient::getScope(xrootd_hosts, scope)) {
+		result.SetErrorValue();
+		CondorErrMsg = std::string("Too many distinct Xrootd hostnames passed to ") + name + ".";
+		return false;
+	}
+
+	// Prefetches are not hedged; they go to the preferred redirector.
+	std::vector<FileMappingClient *> clients;
+	if (!get_clients(name, xrootd_hosts, clients)) {
+		result.SetErrorValue();
+		return false;
+	}
+
+	PrefetchQueue &queue = PrefetchQueue::getInstance();
+	bool queued = true;
+	for (std::vector<std::string>::const_iterator it = filenames.begin(); it != filenames.end(); ++it)
+	{
+		if (!queue.enqueue(*clients[0], scope, *it, PrefetchHigh))
 		{
-			ResponseCache::addToList(hosts, result_list);
+			queued = false;
+			break;
 		}
 	}
+	release_clients(clients);
 
-	result.SetListValue(result_list.get());
-
+	result.SetBooleanValue(queued);
 	return true;
 }
 
+
+/****************************************************************************
+ *
+ * Report the module's statistics.
+ * To use:
+ *  xrootd_mapping_stats()
+ *
+ * Returns a ClassAd with the counters since the module was loaded (cache
+ * hits and misses, lookups by outcome, and so on), the current cache size,
+ * and the 50th, 99th and 99.9th percentile latencies, in microseconds, of
+ * files_to_sites calls, redirector lookups, and DNS lookups.
+ *
+ ****************************************************************************/
+static bool xrootd_mapping_stats(
+	const char         *name,
+	const ArgumentList &arguments,
+	EvalState          &, // state
+	Value              &result)
+{
+	if (arguments.size() != 0) {
+		result.SetErrorValue();
+		CondorErrMsg = std::string("Invalid number of arguments passed to ") + name + "; none allowed.";
+		return false;
+	}
+
+	std::vector<std::pair<std::string, long long> > values;
+	Stats::getInstance().collect(values);
+
+	// Every call gets its own ad, owned by the result.
+	classad_shared_ptr<ClassAd> ad(new ClassAd());
+	for (std::vector<std::pair<std::string, long long> >::const_iterator it = values.begin(); it != values.end(); ++it)
+	{
+		ad->InsertAttr(it->first, it->second);
+	}
+	result.SetClassAdValue(ad);
+	return true;
+}